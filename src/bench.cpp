@@ -0,0 +1,681 @@
+// load generator for master_server
+// starts a server on loopback, drives it with simulated list clients and game servers and reports
+// throughput, latency percentiles and the server's RSS and CPU time for each scenario
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <cerrno>
+
+#include "cube.h"
+#include <signal.h>
+
+constexpr int MAXEVENTS = 256;
+constexpr int REGISTER_TIME = 10000;                     // ms to wait for a registration storm to settle
+constexpr int GAMEPORT = 28785;                          // every simulated server uses its own address, so one port will do
+constexpr int RELOAD_TIME = 500;                         // ms between SIGHUPs in the reload scenario
+
+// source address groups, so per-host limits in the server never see more than one connection per host
+enum
+{
+    SOURCE_LIST = 1,
+    SOURCE_SERVER,
+    SOURCE_SILENT
+};
+
+enum
+{
+    CONN_LIST = 0,
+    CONN_REG,
+    CONN_PING
+};
+
+struct conn
+{
+    int fd, kind;
+    bool connected;
+    unsigned long long start;
+    slothandle handle;
+    std::vector<char> reply;
+};
+slotmap<conn> conns;
+
+struct options
+{
+    const char *server;
+    int port, clients, requests, gameservers, workers, seconds, bans;
+};
+options opts = {"./master_server", 42170, 1000, 20000, 500, 0, 20, 100000};
+
+int epfd = -1;
+pid_t serverpid = -1;
+string serverdir;
+
+// per scenario results
+histogram *listlat = nullptr,
+          *reglat = nullptr;
+int listtarget = 0, //lists to complete, or -1 to keep going until liststop
+    listlaunched = 0,
+    listdone = 0,
+    listerrors = 0,
+    listactive = 0,
+    registered = 0,
+    regerrors = 0,
+    failregs = 0,
+    silentlaunched = 0;
+bool liststop = false;
+
+unsigned long long getmicros()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000ULL + ts.tv_nsec/1000;
+}
+
+// consecutive sources land in different /24s, so the server's per-subnet rate limits see an even spread
+in_addr_t sourceip(int group, int i)
+{
+    return htonl((127U<<24) | ((group*16 + (i/250)%16)<<16) | ((i%250 + 1)<<8) | ((i/4000)%250 + 1));
+}
+
+int opensocket(int type, in_addr_t src, int port)
+{
+    int fd = socket(AF_INET, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+    {
+        return -1;
+    }
+    int one = 1;
+    if(type == SOCK_STREAM)
+    {
+        setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one)); //ports are only picked at connect
+    }
+    sockaddr_in sin = {};
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = src;
+    sin.sin_port = htons(port);
+    if(bind(fd, reinterpret_cast<sockaddr *>(&sin), sizeof(sin)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void closeconn(conn *c)
+{
+    close(c->fd); //also removes it from epoll
+    conns.remove(c->handle);
+    delete c;
+}
+
+void watchconn(conn *c, uint events)
+{
+    c->handle = conns.add(c);
+    epoll_event ev;
+    ev.events = events;
+    ev.data.u64 = c->handle.id();
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+}
+
+conn *connectmaster(int kind, in_addr_t src, const char *request)
+{
+    int fd = opensocket(SOCK_STREAM, src, 0);
+    if(fd < 0)
+    {
+        return nullptr;
+    }
+    sockaddr_in sin = {};
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = htons(opts.port);
+    if(connect(fd, reinterpret_cast<sockaddr *>(&sin), sizeof(sin)) < 0 && errno != EINPROGRESS)
+    {
+        close(fd);
+        return nullptr;
+    }
+    conn *c = new conn;
+    c->fd = fd;
+    c->kind = kind;
+    c->connected = false;
+    c->start = getmicros();
+    c->reply.assign(request, request + strlen(request)); //holds the request until it is sent
+    watchconn(c, EPOLLOUT | EPOLLIN);
+    return c;
+}
+
+void launchlists()
+{
+    while(listactive < opts.clients && (listtarget < 0 ? !liststop : listlaunched < listtarget))
+    {
+        if(!connectmaster(CONN_LIST, sourceip(SOURCE_LIST, listlaunched % 1000000), "list\n"))
+        {
+            listerrors++;
+            return;
+        }
+        listlaunched++;
+        listactive++;
+    }
+}
+
+void finishlist(conn *c, bool ok)
+{
+    if(ok && c->reply.size() && c->reply.back() == '\0')
+    {
+        listlat->add(getmicros() - c->start);
+        listdone++;
+    }
+    else
+    {
+        listerrors++;
+    }
+    listactive--;
+    closeconn(c);
+    launchlists();
+}
+
+// registers a simulated game server; silent ones never answer pings so the master eventually fails them
+bool launchserver(int group, int i)
+{
+    in_addr_t src = sourceip(group, i);
+    if(group == SOURCE_SERVER)
+    {
+        int fd = opensocket(SOCK_DGRAM, src, GAMEPORT);
+        if(fd < 0)
+        {
+            return false;
+        }
+        conn *p = new conn;
+        p->fd = fd;
+        p->kind = CONN_PING;
+        p->connected = true;
+        watchconn(p, EPOLLIN);
+    }
+    DEF_FORMAT_STRING(request, "regserv %d\n", GAMEPORT);
+    return connectmaster(CONN_REG, src, request) != nullptr;
+}
+
+void answerpings(conn *c)
+{
+    for(;;)
+    {
+        uchar buf[512];
+        sockaddr_in from;
+        socklen_t fromlen = sizeof(from);
+        ssize_t len = recvfrom(c->fd, buf, sizeof(buf) - 2, 0, reinterpret_cast<sockaddr *>(&from), &fromlen);
+        if(len < 0)
+        {
+            return;
+        }
+        buf[len++] = 0; //ping data is echoed, followed by a little server info
+        buf[len++] = 0;
+        sendto(c->fd, buf, len, 0, reinterpret_cast<sockaddr *>(&from), fromlen);
+    }
+}
+
+// scans registration replies line by line, dropping them once handled
+void checkregreply(conn *c)
+{
+    for(;;)
+    {
+        auto end = std::find(c->reply.begin(), c->reply.end(), '\n');
+        if(end == c->reply.end())
+        {
+            return;
+        }
+        if(c->reply.size() >= 7 && !memcmp(c->reply.data(), "succreg", 7))
+        {
+            reglat->add(getmicros() - c->start);
+            registered++;
+        }
+        else if(c->reply.size() >= 7 && !memcmp(c->reply.data(), "failreg", 7))
+        {
+            failregs++;
+        }
+        c->reply.erase(c->reply.begin(), end + 1);
+    }
+}
+
+void handleconn(conn *c, uint events)
+{
+    if(c->kind == CONN_PING)
+    {
+        answerpings(c);
+        return;
+    }
+    if(!c->connected && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+    {
+        int err = 0;
+        socklen_t errlen = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+        if(err || send(c->fd, c->reply.data(), c->reply.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(c->reply.size()))
+        {
+            if(c->kind == CONN_LIST)
+            {
+                finishlist(c, false);
+            }
+            else
+            {
+                regerrors++;
+                closeconn(c);
+            }
+            return;
+        }
+        c->connected = true;
+        c->reply.clear();
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = c->handle.id();
+        epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        return;
+    }
+    for(;;)
+    {
+        char buf[16384];
+        ssize_t len = recv(c->fd, buf, sizeof(buf), 0);
+        if(len > 0)
+        {
+            c->reply.insert(c->reply.end(), buf, buf + len);
+            continue;
+        }
+        if(len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            break;
+        }
+        if(c->kind == CONN_LIST)
+        {
+            finishlist(c, !len);
+        }
+        else
+        {
+            closeconn(c);
+        }
+        return;
+    }
+    if(c->kind == CONN_REG)
+    {
+        int oldfailregs = failregs;
+        checkregreply(c);
+        if(failregs != oldfailregs)
+        {
+            closeconn(c); //silent servers are done once failed
+        }
+    }
+}
+
+void pump(int timeout)
+{
+    epoll_event events[MAXEVENTS];
+    int numevents = epoll_wait(epfd, events, MAXEVENTS, timeout);
+    for(int i = 0; i < numevents; i++)
+    {
+        if(conn *c = conns.get(slothandle::fromid(events[i].data.u64)))
+        {
+            handleconn(c, events[i].events);
+        }
+    }
+}
+
+struct procstats
+{
+    double cpu; //user plus system seconds
+    long rss, hwm; //kB
+};
+
+procstats getprocstats(pid_t pid)
+{
+    procstats ps = {0, 0, 0};
+    DEF_FORMAT_STRING(statname, "/proc/%d/stat", int(pid));
+    FILE *f = fopen(statname, "r");
+    if(f)
+    {
+        unsigned long utime = 0, stime = 0;
+        if(fscanf(f, "%*d (%*[^)]) %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) == 2)
+        {
+            ps.cpu = double(utime + stime)/sysconf(_SC_CLK_TCK);
+        }
+        fclose(f);
+    }
+    DEF_FORMAT_STRING(statusname, "/proc/%d/status", int(pid));
+    f = fopen(statusname, "r");
+    if(f)
+    {
+        char line[256];
+        while(fgets(line, sizeof(line), f))
+        {
+            sscanf(line, "VmRSS: %ld", &ps.rss);
+            sscanf(line, "VmHWM: %ld", &ps.hwm);
+        }
+        fclose(f);
+    }
+    return ps;
+}
+
+void writeconfig(int numbans)
+{
+    DEF_FORMAT_STRING(cfgname, "%smaster.cfg", serverdir);
+    FILE *f = fopen(cfgname, "w");
+    if(!f)
+    {
+        return;
+    }
+    for(int i = 0; i < numbans; i++)
+    {
+        fprintf(f, "ban 10.%d.%d.0/24\n", (i>>8)&0xFF, i&0xFF); //never matches the 127/8 loopback sources
+    }
+    fclose(f);
+}
+
+bool startserver()
+{
+    writeconfig(0);
+    DEF_FORMAT_STRING(snapname, "%smaster.snap", serverdir);
+    unlink(snapname); //the last scenario's server saved its servers on exit, and every scenario starts empty
+    serverpid = fork();
+    if(!serverpid)
+    {
+        DEF_FORMAT_STRING(port, "%d", opts.port);
+        DEF_FORMAT_STRING(workers, "%d", opts.workers);
+        execl(opts.server, opts.server, serverdir, port, "127.0.0.1", workers, static_cast<char *>(nullptr));
+        _exit(127);
+    }
+    if(serverpid < 0)
+    {
+        return false;
+    }
+    for(int tries = 0; tries < 100; tries++) //up to a second for the server to listen
+    {
+        usleep(10000);
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in sin = {};
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        sin.sin_port = htons(opts.port);
+        bool ok = !connect(fd, reinterpret_cast<sockaddr *>(&sin), sizeof(sin));
+        close(fd);
+        if(ok)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void stopserver()
+{
+    if(serverpid > 0)
+    {
+        kill(serverpid, SIGTERM);
+        waitpid(serverpid, nullptr, 0);
+        serverpid = -1;
+    }
+    for(int i = conns.size(); --i >=0;) //note reverse iteration
+    {
+        closeconn(conns[i]);
+    }
+}
+
+void resetstats()
+{
+    delete listlat;
+    delete reglat;
+    listlat = new histogram;
+    reglat = new histogram;
+    listtarget = listlaunched = listdone = listerrors = listactive = 0;
+    registered = regerrors = failregs = silentlaunched = 0;
+    liststop = false;
+}
+
+void report(const char *scenario, const char *what, int ops, int errors, const histogram &lat, double secs, const procstats &before, const procstats &after)
+{
+    printf("%-10s %-8s %8d %10.0f %9.3f %9.3f %9.3f %7d %8.1f %8.1f %7.2f\n",
+           scenario, what, ops, ops/std::max(secs, 1e-6),
+           lat.percentile(0.5)/1000.0, lat.percentile(0.99)/1000.0, lat.percentile(0.999)/1000.0,
+           errors, after.rss/1024.0, after.hwm/1024.0, after.cpu - before.cpu);
+    fflush(stdout);
+}
+
+// registers opts.gameservers answering servers at once and waits for every succreg
+bool registerservers()
+{
+    for(int i = 0; i < opts.gameservers; i++)
+    {
+        if(!launchserver(SOURCE_SERVER, i))
+        {
+            regerrors++;
+        }
+    }
+    unsigned long long deadline = getmicros() + REGISTER_TIME*1000ULL;
+    while(registered + regerrors < opts.gameservers && getmicros() < deadline)
+    {
+        pump(10);
+    }
+    return registered > 0;
+}
+
+// many clients asking for the full list at once
+void benchlist()
+{
+    registerservers();
+    procstats before = getprocstats(serverpid);
+    unsigned long long start = getmicros();
+    listtarget = opts.requests;
+    launchlists();
+    while(listactive)
+    {
+        pump(100);
+    }
+    report("list", "list", listdone, listerrors, *listlat, (getmicros() - start)/1e6, before, getprocstats(serverpid));
+}
+
+// every game server registering at once, timed from connect until succreg
+void benchregserv()
+{
+    procstats before = getprocstats(serverpid);
+    unsigned long long start = getmicros();
+    registerservers();
+    report("regserv", "succreg", registered, regerrors, *reglat, (getmicros() - start)/1e6, before, getprocstats(serverpid));
+}
+
+// list storm while servers that never answer pings keep registering and timing out
+void benchchurn()
+{
+    registerservers();
+    procstats before = getprocstats(serverpid);
+    unsigned long long start = getmicros(),
+                       end = start + opts.seconds*1000000ULL;
+    listtarget = -1;
+    launchlists();
+    int rate = std::max(opts.gameservers/opts.seconds, 1); //silent servers per second
+    while(getmicros() < end)
+    {
+        int due = static_cast<int>((getmicros() - start)*rate/1000000ULL);
+        while(silentlaunched < due)
+        {
+            if(!launchserver(SOURCE_SILENT, silentlaunched++))
+            {
+                regerrors++;
+            }
+        }
+        pump(10);
+    }
+    liststop = true;
+    while(listactive)
+    {
+        pump(100);
+    }
+    double secs = (getmicros() - start)/1e6;
+    procstats after = getprocstats(serverpid);
+    report("churn", "list", listdone, listerrors, *listlat, secs, before, after);
+    report("churn", "failreg", failregs, regerrors, histogram(), secs, before, after);
+}
+
+// list storm while a large config is reloaded over and over
+void benchreload()
+{
+    registerservers();
+    writeconfig(opts.bans);
+    procstats before = getprocstats(serverpid);
+    unsigned long long start = getmicros(),
+                       end = start + opts.seconds*1000000ULL,
+                       nextreload = start;
+    int reloads = 0;
+    listtarget = -1;
+    launchlists();
+    while(getmicros() < end)
+    {
+        if(getmicros() >= nextreload)
+        {
+            kill(serverpid, SIGHUP);
+            reloads++;
+            nextreload += RELOAD_TIME*1000ULL;
+        }
+        pump(10);
+    }
+    liststop = true;
+    while(listactive)
+    {
+        pump(100);
+    }
+    report("reload", "list", listdone, listerrors, *listlat, (getmicros() - start)/1e6, before, getprocstats(serverpid));
+    printf("%-10s %d SIGHUPs with %d bans\n", "reload", reloads, opts.bans);
+}
+
+int failures = 0; // checks that did not hold, which make the run exit with EXIT_FAILURE
+
+// a second server on the busy port must log why and exit with status 1, not abort
+void benchbindfail()
+{
+    pid_t pid = fork();
+    if(!pid)
+    {
+        DEF_FORMAT_STRING(port, "%d", opts.port);
+        execl(opts.server, opts.server, serverdir, port, "127.0.0.1", "0", static_cast<char *>(nullptr)); //no SO_REUSEPORT, so it cannot share the port
+        _exit(127);
+    }
+    int status = 0;
+    if(pid < 0 || waitpid(pid, &status, 0) < 0)
+    {
+        status = -1;
+    }
+    bool ok = WIFEXITED(status) && WEXITSTATUS(status) == EXIT_FAILURE;
+    if(!ok)
+    {
+        failures++;
+    }
+    printf("%-10s second server on port %d %s %d%s\n", "bindfail", opts.port,
+           WIFSIGNALED(status) ? "killed by signal" : "exited with status",
+           WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status), ok ? "" : ", expected status 1");
+}
+
+struct scenario
+{
+    const char *name;
+    void (*run)();
+};
+
+const scenario scenarios[] =
+{
+    {"list", benchlist},
+    {"regserv", benchregserv},
+    {"churn", benchchurn},
+    {"reload", benchreload},
+    {"bindfail", benchbindfail}
+};
+
+void usage()
+{
+    printf("usage: master_bench [options] [scenario...]\n"
+           "scenarios: list regserv churn reload bindfail (default: all)\n"
+           "  -s path    master_server binary (%s)\n"
+           "  -p port    port to run it on (%d)\n"
+           "  -w n       list workers (%d)\n"
+           "  -c n       concurrent list clients (%d)\n"
+           "  -n n       lists requested in the list scenario (%d)\n"
+           "  -g n       game servers (%d)\n"
+           "  -t secs    duration of the churn and reload scenarios (%d)\n"
+           "  -b n       bans in the reloaded config (%d)\n",
+           opts.server, opts.port, opts.workers, opts.clients, opts.requests, opts.gameservers, opts.seconds, opts.bans);
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<const scenario *> torun;
+    for(int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        if(arg[0] == '-' && arg[1] && !arg[2] && i+1 < argc)
+        {
+            const char *val = argv[++i];
+            switch(arg[1])
+            {
+                case 's': opts.server = val; break;
+                case 'p': opts.port = atoi(val); break;
+                case 'w': opts.workers = atoi(val); break;
+                case 'c': opts.clients = std::max(atoi(val), 1); break;
+                case 'n': opts.requests = atoi(val); break;
+                case 'g': opts.gameservers = std::clamp(atoi(val), 0, 1000000); break;
+                case 't': opts.seconds = std::max(atoi(val), 1); break;
+                case 'b': opts.bans = atoi(val); break;
+                default: usage(); return EXIT_FAILURE;
+            }
+            continue;
+        }
+        bool found = false;
+        for(const scenario &s : scenarios)
+        {
+            if(!strcmp(arg, s.name))
+            {
+                torun.push_back(&s);
+                found = true;
+            }
+        }
+        if(!found)
+        {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if(torun.empty())
+    {
+        for(const scenario &s : scenarios)
+        {
+            torun.push_back(&s);
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+    rlimit lim;
+    if(!getrlimit(RLIMIT_NOFILE, &lim))
+    {
+        lim.rlim_cur = lim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &lim);
+    }
+    char dirtemplate[] = "/tmp/master_bench.XXXXXX";
+    if(!mkdtemp(dirtemplate))
+    {
+        fprintf(stderr, "failed to create a directory for the server\n");
+        return EXIT_FAILURE;
+    }
+    formatstring(serverdir, "%s/", dirtemplate);
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    printf("%-10s %-8s %8s %10s %9s %9s %9s %7s %8s %8s %7s\n",
+           "scenario", "op", "count", "ops/s", "p50 ms", "p99 ms", "p999 ms", "errors", "rss MB", "peak MB", "cpu s");
+    for(uint i = 0; i < torun.size(); i++)
+    {
+        resetstats();
+        if(!startserver())
+        {
+            fprintf(stderr, "failed to start %s on port %d\n", opts.server, opts.port);
+            stopserver();
+            return EXIT_FAILURE;
+        }
+        torun[i]->run();
+        stopserver();
+    }
+    printf("server logs in %s\n", serverdir);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
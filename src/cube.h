@@ -2,11 +2,16 @@
 #define __CUBE_H__
 
 #include <algorithm>
+#include <atomic>
 #include <ctime>
 #include <cstring>
 #include <cstdarg>
 #include <cassert>
 #include <iostream>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
 #include <enet/enet.h>
 
 #include "tools.h"
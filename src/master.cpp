@@ -1,60 +1,212 @@
 #include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
+#include <thread>
 
 #include "cube.h"
 #include <signal.h>
+#include <zlib.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
 #include <enet/etime.h>
 
 constexpr unsigned int INPUT_LIMIT = 4096;
+constexpr unsigned int INPUT_INLINE = 128;               // input kept inside the client until a line outgrows it
 constexpr unsigned int OUTPUT_LIMIT = (64*1024);
 constexpr unsigned int CLIENT_TIME = (3*60*1000);
 constexpr unsigned int CLIENT_LIMIT = 4096;
 constexpr unsigned int DUP_LIMIT = 16;
-constexpr unsigned int PING_TIME = 3000;
-constexpr unsigned int PING_RETRY = 5;
+constexpr unsigned int PING_TIME = 3000;                 // longest wait for a pong before pinging again
+constexpr unsigned int PING_MIN_TIME = 250;              // shortest, for servers that answered quickly before
+constexpr unsigned int PING_RETRY = 5;                   // a server fails once it missed this many pings over PING_RETRY*PING_TIME
+constexpr unsigned int PING_RATE = 1000;                 // default for pingrate, the pings sent per second
+constexpr unsigned int PING_JITTER = 10;                 // percent ping timeouts and info refreshes are randomly moved by
 constexpr unsigned int KEEPALIVE_TIME = (65*60*1000);
 constexpr unsigned int SERVER_LIMIT = 4096;
 constexpr unsigned int SERVER_DUP_LIMIT = 10;
 constexpr unsigned int MAXTRANS = 5000;                  // max amount of data to swallow in 1 go
+constexpr unsigned int MAXEVENTS = 256;                  // max epoll events handled per wakeup
+constexpr unsigned int PINGBATCH_LIMIT = 1024;           // max datagrams per sendmmsg/recvmmsg call
+constexpr unsigned int LISTENTRY_LEN = 40;               // fits "addserver 255.255.255.255 65535\n"
+constexpr unsigned int INFO_TIME = (30*1000);            // how often listed servers are pinged again to refresh their info
+constexpr unsigned int INFOLIST_TIME = 1000;             // min time between rebuilds of the listinfo reply
+constexpr unsigned int INFO_ATTRS = 8;                   // server info attributes kept, any more are skipped
+constexpr unsigned int INFOENTRY_LEN = 256;              // fits a serverinfo line with every attribute, the map and the description
+constexpr unsigned int OUTPUTPOOL_SIZE = 256;            // spare reply buffers kept from purged clients
+constexpr unsigned int LISTDELTA_LIMIT = 64;             // server list versions that list since can catch up from
+constexpr unsigned int FILTERCACHE_LIMIT = 64;           // distinct filtered lists cached per server list version
+constexpr unsigned int GBANLOG_LIMIT = 64;               // gban versions kept for registered servers to catch up from
+constexpr unsigned int GBANLOG_BYTES = (1024*1024);      // the log also stops at this size, but always keeps the newest
+constexpr unsigned int SNAPSHOT_TIME = (60*1000);        // how often the listed servers are saved for a warm restart
+constexpr unsigned int SNAPSHOT_VERSION = 1;
+constexpr unsigned int RATE_HOST = 16;                   // connects, lists and regservs per second from one host
+constexpr unsigned int RATE_HOST_BURST = 64;
+constexpr unsigned int RATE_SUBNET = 64;                 // the same across a /24
+constexpr unsigned int RATE_SUBNET_BURST = 256;
+constexpr unsigned int AUTH_TIME = (30*1000);            // challenges not answered within this expire
+constexpr unsigned int AUTH_LIMIT = 100;                 // max pending challenges per client
+constexpr unsigned int AUTH_THROTTLE = 1000;             // min time between reqauths from one client
+constexpr unsigned int AUTH_WORKERS = 2;                 // threads verifying signatures
+constexpr unsigned int AUTH_QUEUE = 1024;                // max signatures being verified, a power of two
+constexpr unsigned int LOG_QUEUE = 1024;                 // log lines waiting to be written, a power of two
+constexpr unsigned int LOG_FLUSH_TIME = 50;              // how long the log writer lets lines pile up before writing them
+constexpr unsigned int LOG_ROTATE_SIZE = (64*1024*1024); // master.log is moved to master.log.1 once it grows past this
 
 FILE *logfile = nullptr;
 
-std::vector<ipmask> bans, servbans, gbans;
+// the registry thread (shard 0) owns game servers, registered clients and config
+// list workers (shards 1 and up) accept on their own SO_REUSEPORT socket and only serve list
+thread_local int shard = 0;
+std::atomic<bool> stopthreads(false); // set once the registry quits, so list and auth workers return and can be joined
 
-void addban(std::vector<ipmask> &bans, const char *name)
+banlist bans, servbans, gbans;
+std::shared_mutex banlock; // held exclusively while the ban lists change
+std::atomic<int> banversion(0);
+thread_local int lastbanversion = 0;
+banlist addedbans; // client bans that were not in the previous config, so shards only recheck against these
+
+void addban(banlist &bans, const char *name)
 {
-    ipmask ban;
-    ban.parse(name);
-    bans.push_back(ban);
+    bans.add(name);
 }
 
-bool checkban(std::vector<ipmask> &bans, enet_uint32 host)
+bool checkban(const banlist &bans, enet_uint32 host)
 {
-    for(uint i = 0; i < bans.size(); i++)
-    {
-        if(bans.at(i).check(host))
-        {
-            return true;
-        }
-    }
-    return false;
+    std::shared_lock<std::shared_mutex> lock(banlock);
+    return bans.check(host);
 }
 
+struct client;
+
+// what a server said about itself in its last pong: player count, then attributes that clients interpret
+// (for the engine: protocol, mode, seconds left, max players and master mode), then map and description
+struct serverinfo
+{
+    int players, numattrs, attrs[INFO_ATTRS];
+    char map[32], desc[64];
+};
+
 struct gameserver
 {
     ENetAddress address;
-    string ip;
     int port, numpings;
     enet_uint32 lastping, lastpong;
+    enet_uint32 firstping, infoping; // first registration ping, and the info ping still unanswered or 0
+    int srtt, rttvar, loss; // smoothed round trip and its variation in milliseconds, -1 until measured, and percent of info pings lost
+    bool paced; // already waited for its slot under pingrate
+    bool hasinfo; // info holds a parsed pong, formatted only when listinfo is built
+    char listentry[LISTENTRY_LEN]; // preformatted line for the server list, sent once the server has ponged
+    int listlen, listpos; // listpos is where listentry sits in the newest server list, -1 until it is in one
+    serverinfo info;
+    client *owner; // connection that registered this server, if still connected
+    slothandle handle;
+    timer pingtimer; // next ping, ping timeout or keepalive expiry
+};
+slabpool<gameserver> gameserverpool;
+slotmap<gameserver> gameservers;
+thread_local timerwheel timers;
+hashindex<unsigned long long, gameserver *> gameserverindex; // keyed by serverkey()
+hashindex<enet_uint32, int> gameserverhosts; // registered servers per host, for SERVER_DUP_LIMIT
+
+unsigned long long serverkey(enet_uint32 host, int port)
+{
+    return (static_cast<unsigned long long>(host) << 16) | static_cast<unsigned long long>(port & 0xFFFF);
+}
+
+gameserver *findgameserver(enet_uint32 host, int port)
+{
+    gameserver **s = gameserverindex.find(serverkey(host, port));
+    return s ? *s : nullptr;
+}
+
+bool updateserverlist = true,
+     rebuildserverlist = false; // the next list must be built from scratch rather than patched
+std::vector<gameserver *> pendinglisted; // servers that first ponged since the last list was generated
+std::vector<char> pendingdelisted; // delserver lines for listed servers removed since the last list was generated
+
+// removed servers are blanked out of the list where they stand, and the list is compacted once a quarter of it is blanks
+struct listhole
+{
+    int pos, len;
 };
-std::vector<gameserver *> gameservers;
+std::vector<listhole> pendingholes; // entries of servers removed since the last list was generated
+int serverlistholes = 0; // bytes blanked out of the newest list
+std::vector<gameserver *> hostorder, portorder; // listed servers by address then port and by port then address, for filtered lists
+
+bool hostless(const gameserver *a, const gameserver *b)
+{
+    enet_uint32 x = ENET_NET_TO_HOST_32(a->address.host), y = ENET_NET_TO_HOST_32(b->address.host);
+    return x < y || (x == y && a->port < b->port);
+}
+
+bool portless(const gameserver *a, const gameserver *b)
+{
+    return a->port < b->port || (a->port == b->port && ENET_NET_TO_HOST_32(a->address.host) < ENET_NET_TO_HOST_32(b->address.host));
+}
+
+void indexlisted(gameserver &s)
+{
+    hostorder.insert(std::upper_bound(hostorder.begin(), hostorder.end(), &s, hostless), &s);
+    portorder.insert(std::upper_bound(portorder.begin(), portorder.end(), &s, portless), &s);
+}
+
+void unindexlisted(gameserver &s)
+{
+    hostorder.erase(std::lower_bound(hostorder.begin(), hostorder.end(), &s, hostless));
+    portorder.erase(std::lower_bound(portorder.begin(), portorder.end(), &s, portless));
+}
+
+void removegameserver(gameserver &s)
+{
+    if(s.lastpong)
+    {
+        auto pending = std::find(pendinglisted.begin(), pendinglisted.end(), &s);
+        if(pending != pendinglisted.end()) //never made it into a list
+        {
+            pendinglisted.erase(pending);
+        }
+        else
+        {
+            static const char del[] = "delserver";
+            pendingdelisted.insert(pendingdelisted.end(), del, del + strlen(del));
+            pendingdelisted.insert(pendingdelisted.end(), s.listentry + strlen("addserver"), s.listentry + s.listlen);
+            unindexlisted(s);
+            pendingholes.push_back({s.listpos, s.listlen});
+        }
+        updateserverlist = true;
+    }
+    gameserverindex.remove(serverkey(s.address.host, s.port));
+    int &dups = gameserverhosts.access(s.address.host, 0);
+    if(--dups <= 0)
+    {
+        gameserverhosts.remove(s.address.host);
+    }
+    timers.cancel(s.pingtimer);
+    gameservers.remove(s.handle);
+    gameserverpool.release(&s);
+}
 
 struct messagebuf
 {
     std::vector<messagebuf *> &owner;
     std::vector<char> buf;
-    int refs;
+    int refs; // guarded by messagelock, like the owner lists
+    unsigned long long version; // server list or gban log version
 
-    messagebuf(std::vector<messagebuf *> &owner) : owner(owner), refs(0) {}
+    messagebuf(std::vector<messagebuf *> &owner) : owner(owner), refs(0), version(0) {}
 
     const char *getbuf()
     {
@@ -66,97 +218,597 @@ struct messagebuf
         return buf.size();
     }
     void purge();
+};
+std::vector<messagebuf *> gameserverlists, gameserverlistsz,
+                          gbanlists, // full lists: cleargbans then every gban
+                          gbandeltas; // gban log entries still in the log or being sent
+std::mutex messagelock;
+bool updateserverlistz = true; // guarded by messagelock, the newest list has not been compressed yet
+
+// registered servers get the gbans added since the version they have, one log entry at a time
+std::vector<messagebuf *> gbanlog; // guarded by messagelock, oldest first and without gaps
+unsigned long long gbanlogversion = 0; // version of the newest entry
+size_t gbanlogbytes = 0;
+bool updategbanlist = true; // guarded by messagelock, gbans changed since the newest full list was built
+
+struct listdelta
+{
+    unsigned long long version; // server list version this delta leads to
+    std::vector<char> buf; // delserver and addserver lines relative to the version before
+};
+std::vector<listdelta> listdeltas; // guarded by messagelock, oldest first and without gaps
+
+std::vector<messagebuf *> filteredlists; // guarded by messagelock, cached or still being sent
+hashindex<std::string, messagebuf *> filteredcache; // guarded by messagelock, filtered lists of the newest server list, each holding a ref
 
-    bool equals(const messagebuf &m) const
+std::vector<messagebuf *> serverinfolists; // guarded by messagelock, the listed servers with their cached info, for listinfo
+bool updateserverinfo = true; // the listed servers or their info changed since the newest listinfo reply was built
+enet_uint32 serverinfotime = 0;
+timer serverinfotimer; // registry only, rebuilds listinfo once the throttle allows
+
+// marks the listinfo reply stale and arms its rebuild for when INFOLIST_TIME allows, so a quiet registry still publishes it
+void invalidateserverinfo()
+{
+    updateserverinfo = true;
+    if(!serverinfotimer.scheduled())
     {
-        return buf.size() == m.buf.size() && !memcmp(buf.data(), m.buf.data(), buf.size());
+        timers.schedule(serverinfotimer, serverinfotime + INFOLIST_TIME);
     }
+}
 
-    bool endswith(const messagebuf &m) const
+// drops every cached filtered list, once the server list changes; messagelock must be held
+void invalidatefilteredlists()
+{
+    for(uint i = 0; i < filteredcache.slots.size(); i++)
     {
-        return buf.size() >= m.buf.size() && !memcmp(&buf[buf.size() - m.buf.size()], m.buf.data(), m.buf.size());
+        if(filteredcache.slots[i].used)
+        {
+            filteredcache.slots[i].value->refs--;
+        }
     }
-
-    void concat(const messagebuf &m)
+    filteredcache.clear();
+    for(int i = filteredlists.size(); --i >=0;) //note reverse iteration
     {
-        if(buf.size() && buf.back() == '\0')
+        if(filteredlists[i]->refs <= 0)
         {
-            buf.pop_back();
+            delete filteredlists[i];
+            filteredlists.erase(filteredlists.begin() + i);
         }
-        buf.insert(buf.end(), m.buf.begin(), m.buf.end());
     }
+}
+
+struct inputbuffer
+{
+    char data[INPUT_LIMIT];
+};
+thread_local slabpool<inputbuffer, 16> inputpool;
+
+struct userkey
+{
+    uchar pubkey[32]; // ed25519
+};
+
+struct authreq
+{
+    enet_uint32 reqtime;
+    uint id;
+    uchar pubkey[32], challenge[32];
 };
-std::vector<messagebuf *> gameserverlists, gbanlists;
-bool updateserverlist = true;
 
 struct client
 {
     ENetAddress address;
     ENetSocket socket;
-    char input[INPUT_LIMIT];
     messagebuf *message;
-    std::string output;
-    int inputpos, outputpos;
+    char *input; // inlineinput, or a buffer from inputpool once a line outgrows it
+    int inputstart, inputpos, inputsize, outputpos, messagepos; // input before inputstart has been parsed
     enet_uint32 connecttime, lastinput;
     int servport;
     enet_uint32 lastauth;
     bool shouldpurge;
     bool registeredserver;
+    bool writing; // socket is registered with the reactor for writes rather than reads
+    bool admin; // connected to the admin port, where only stats is answered
+    bool ratecharged; // the line being handled was already charged to the rate limits by the shard that handed it off
+    slothandle handle;
+    unsigned long long requesttime; // when the list being sent was asked for, in microseconds
+    unsigned long long gbancursor; // next gban log version to send, 0 until the server has registered
+    client *hostprev, *hostnext; // ring of connections from the same host on this shard, oldest first
+    timer idletimer;
+    std::vector<char> output; // replies, sent ahead of message unless message is partly sent
+    std::vector<authreq> authreqs; // challenges sent, oldest first
+    char inlineinput[INPUT_INLINE];
+
+    client() : message(nullptr), input(inlineinput), inputstart(0), inputpos(0), inputsize(INPUT_INLINE), outputpos(0), messagepos(0), servport(-1), lastauth(0), shouldpurge(false), registeredserver(false), writing(false), admin(false), ratecharged(false), requesttime(0), gbancursor(0) {}
+    client(const client &) = delete;
+    client &operator=(const client &) = delete;
+
+    ~client()
+    {
+        if(input != inlineinput)
+        {
+            inputpool.release(reinterpret_cast<inputbuffer *>(input));
+        }
+    }
 
-    client() : message(nullptr), inputpos(0), outputpos(0), servport(-1), lastauth(0), shouldpurge(false), registeredserver(false) {}
+    bool pending() const
+    {
+        return message || output.size();
+    }
 };
-std::vector<client *> clients;
+thread_local slabpool<client> clientpool;
+thread_local slotmap<client> clients;
+thread_local std::vector<std::vector<char>> outputpool;
+std::atomic<int> numclients(0);
+thread_local hashindex<enet_uint32, client *> hostclients; // oldest connection per host on this shard, heading its ring
+hashindex<enet_uint32, int> hostcounts; // guarded by hostcountlock, connections per host across every shard, for DUP_LIMIT
+std::mutex hostcountlock;
+
+// returns the connections from host across every shard after adding delta
+int counthostclients(enet_uint32 host, int delta)
+{
+    std::lock_guard<std::mutex> lock(hostcountlock);
+    int &n = hostcounts.access(host, 0);
+    n += delta;
+    int result = n;
+    if(n <= 0)
+    {
+        hostcounts.remove(host);
+    }
+    return result;
+}
 
-ENetSocket serversocket = ENET_SOCKET_NULL;
+void linkhostclient(client &c)
+{
+    counthostclients(c.address.host, 1);
+    client *&head = hostclients.access(c.address.host, nullptr);
+    if(!head)
+    {
+        head = c.hostprev = c.hostnext = &c;
+        return;
+    }
+    client *tail = head->hostprev;
+    tail->hostnext = &c;
+    c.hostprev = tail;
+    c.hostnext = head;
+    head->hostprev = &c;
+}
 
-enet_uint32 servtime = 0;
+void unlinkhostclient(client &c)
+{
+    counthostclients(c.address.host, -1);
+    if(c.hostnext == &c)
+    {
+        hostclients.remove(c.address.host);
+        return;
+    }
+    c.hostprev->hostnext = c.hostnext;
+    c.hostnext->hostprev = c.hostprev;
+    client **head = hostclients.find(c.address.host);
+    if(*head == &c)
+    {
+        *head = c.hostnext;
+    }
+}
 
-void fatal(const char *fmt, ...)
+// a connection moved from a list worker to the registry thread, with its unparsed input
+struct handoff
+{
+    ENetSocket socket;
+    ENetAddress address;
+    enet_uint32 connecttime, lastinput;
+    bool charged; // the first line was charged to the rate limits before the handoff
+    std::vector<char> input;
+};
+std::vector<handoff> handoffs;
+std::mutex handofflock;
+
+thread_local ENetSocket serversocket = ENET_SOCKET_NULL;
+ENetSocket adminsocket = ENET_SOCKET_NULL; // loopback only, served by the registry thread
+std::vector<ENetSocket> workersockets;
+
+thread_local int epollfd = -1,
+                 wakefd = -1;
+std::vector<int> shardwakefds;
+
+// reactor event ids for the shared sockets; clients are identified by their handle id
+constexpr unsigned long long SERVER_EVENT = ~0ULL,
+                             PING_EVENT = ~0ULL - 1,
+                             WAKE_EVENT = ~0ULL - 2,
+                             ADMIN_EVENT = ~0ULL - 3;
+
+thread_local enet_uint32 servtime = 0;
+
+// counters reported by the stats command, bumped from any shard
+enum
+{
+    STAT_ACCEPTS = 0,
+    STAT_REJECT_LIMIT,
+    STAT_REJECT_DUP,
+    STAT_REJECT_RATE,
+    STAT_BAN_CLIENT,
+    STAT_BAN_SERVER,
+    STAT_LIST_PLAIN,
+    STAT_LIST_ZLIB,
+    STAT_LIST_DELTA,
+    STAT_LIST_FILTERED,
+    STAT_LIST_INFO,
+    STAT_LIST_BYTES,
+    STAT_SUCCREG,
+    STAT_FAILREG_PORT,
+    STAT_FAILREG_DUP,
+    STAT_FAILREG_RESOLVE,
+    STAT_FAILREG_PING,
+    STAT_PING_LOST_REG,
+    STAT_PING_LOST_INFO,
+    STAT_PING_PACED,
+    STAT_LOG_DROPPED,
+    NUMSTATS
+};
+
+struct statinfo
+{
+    const char *name, *labels, *help; //entries sharing a name must be adjacent
+};
+
+const statinfo statinfos[NUMSTATS] =
+{
+    {"master_accepts_total", "", "connections accepted"},
+    {"master_rejects_total", "reason=\"limit\"", "connections refused by the client or rate limits, or evicted by the per-host limit"},
+    {"master_rejects_total", "reason=\"dup\"", ""},
+    {"master_rejects_total", "reason=\"rate\"", ""},
+    {"master_bans_total", "list=\"ban\"", "connections and game servers refused or dropped by a ban"},
+    {"master_bans_total", "list=\"servban\"", ""},
+    {"master_lists_total", "format=\"plain\"", "server lists sent, in full or as the changes since a version"},
+    {"master_lists_total", "format=\"zlib\"", ""},
+    {"master_lists_total", "format=\"delta\"", ""},
+    {"master_lists_total", "format=\"filtered\"", ""},
+    {"master_lists_total", "format=\"info\"", ""},
+    {"master_list_bytes_total", "", "server list bytes sent"},
+    {"master_regserv_total", "result=\"succreg\"", "regserv outcomes"},
+    {"master_regserv_total", "result=\"invalid_port\"", ""},
+    {"master_regserv_total", "result=\"too_many_servers\"", ""},
+    {"master_regserv_total", "result=\"resolve_failed\"", ""},
+    {"master_regserv_total", "result=\"ping_failed\"", ""},
+    {"master_pings_lost_total", "kind=\"register\"", "game server pings that went unanswered"},
+    {"master_pings_lost_total", "kind=\"info\"", ""},
+    {"master_pings_paced_total", "", "game server pings held back to stay under pingrate"},
+    {"master_log_dropped_total", "", "log lines dropped because the log writer fell behind"}
+};
+
+std::atomic<unsigned long long> stats[NUMSTATS];
+histogram loophist, // microseconds spent handling one wakeup
+          waithist, // microseconds blocked in epoll_wait
+          listhist, // microseconds from a list request until the list is fully sent
+          pinghist, // ping round trips, only millisecond precision
+          pacehist; // how long pings were held back by pingrate, also in milliseconds
+thread_local unsigned long long loopstart = 0;
+
+void addstat(int n, unsigned long long val = 1)
+{
+    stats[n].fetch_add(val, std::memory_order_relaxed);
+}
+
+unsigned long long getmicros()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000ULL + ts.tv_nsec/1000;
+}
+
+// token buckets per host and per /24, shared by every shard so the limits hold however connections are spread
+ratelimiter hostrates(RATE_HOST, RATE_HOST_BURST),
+            subnetrates(RATE_SUBNET, RATE_SUBNET_BURST);
+
+bool checkrate(enet_uint32 host)
+{
+    if(!hostrates.allow(host, servtime) || !subnetrates.allow(host & ENET_HOST_TO_NET_32(0xFFFFFF00), servtime))
+    {
+        addstat(STAT_REJECT_RATE);
+        return false;
+    }
+    return true;
+}
+
+// charges a client's line, unless the shard that handed the client off already did
+bool checkrate(client &c)
+{
+    if(c.ratecharged)
+    {
+        c.ratecharged = false;
+        return true;
+    }
+    return checkrate(c.address.host);
+}
+
+enum
+{
+    LOG_ERROR = 0,
+    LOG_WARN,
+    LOG_INFO,
+    LOG_DEBUG
+};
+
+const char *const loglevelnames[] = {"error", "warn", "info", "debug"};
+
+// lines are formatted by whichever thread logs them and written in batches by runlogwriter
+struct logline
+{
+    int len;
+    char text[MAXSTRLEN];
+};
+mpmcqueue<logline, LOG_QUEUE> loglines;
+std::atomic<int> logpending(0), // lines being queued or waiting to be written
+                 loglevel(LOG_INFO); // lines above this level are not logged
+std::atomic<unsigned long long> logdropped(0); // lines lost to a full queue, not yet reported in the log
+int logfd = -1; // wakes the log writer; until it runs and after it stopped, lines are written straight to logfile
+std::thread logwriter;
+string logname; // rotated once it grows past LOG_ROTATE_SIZE, empty if logfile is not a file
+std::mutex logflushlock;
+std::condition_variable logflushed;
+unsigned long long logflushseq = 0, logflushdone = 0; // guarded by logflushlock, flushes asked for and done
+bool logstop = false; // guarded by logflushlock, the writer returns after writing what is queued
+
+void logoutfv(int level, const char *fmt, va_list args)
+{
+    if(level > loglevel.load(std::memory_order_relaxed))
+    {
+        return;
+    }
+    logline l;
+    l.len = std::clamp(vsnprintf(l.text, sizeof(l.text) - 1, fmt, args), 0, int(sizeof(l.text)) - 2);
+    l.text[l.len++] = '\n';
+    if(logfd < 0)
+    {
+        FILE *f = logfile ? logfile : stderr; //fatal errors can come before the log is open
+        fwrite(l.text, 1, l.len, f);
+        fflush(f);
+        return;
+    }
+    //counted before the push, so the writer cannot go back to sleep while a line is on its way
+    if(!logpending.fetch_add(1))
+    {
+        eventfd_write(logfd, 1);
+    }
+    if(!loglines.push(l))
+    {
+        logpending--;
+        logdropped++;
+        addstat(STAT_LOG_DROPPED);
+    }
+}
+
+void logoutf(int level, const char *fmt, ...)
 {
     va_list args;
     va_start(args, fmt);
-    vfprintf(logfile, fmt, args);
-    fputc('\n', logfile);
+    logoutfv(level, fmt, args);
     va_end(args);
-    exit(EXIT_FAILURE);
 }
 
-void conoutfv(const char *fmt, va_list args)
+void conoutf(const char *fmt, ...)
 {
-    vfprintf(logfile, fmt, args);
-    fputc('\n', logfile);
+    va_list args;
+    va_start(args, fmt);
+    logoutfv(LOG_INFO, fmt, args);
+    va_end(args);
 }
 
-void conoutf(const char *fmt, ...)
+// waits until everything logged so far is on disk, or a second has passed
+void flushlog()
+{
+    if(logfd < 0)
+    {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(logflushlock);
+    unsigned long long seq = ++logflushseq;
+    eventfd_write(logfd, 1);
+    logflushed.wait_for(lock, std::chrono::seconds(1), [seq] { return logflushdone >= seq; });
+}
+
+void fatal(const char *fmt, ...)
 {
     va_list args;
     va_start(args, fmt);
-    conoutfv(fmt, args);
+    logoutfv(LOG_ERROR, fmt, args);
     va_end(args);
+    flushlog();
+    _exit(EXIT_FAILURE); //from any thread, so never runs the destructors of threads that are still joinable
+}
+
+void rotatelog()
+{
+    DEF_FORMAT_STRING(oldname, "%s.1", logname);
+    rename(logname, oldname);
+    FILE *f = fopen(logname, "a");
+    if(f)
+    {
+        fclose(logfile);
+        logfile = f;
+    }
+}
+
+void runlogwriter()
+{
+    std::vector<char> batch;
+    long written = std::max(ftell(logfile), 0L);
+    for(;;)
+    {
+        eventfd_t val;
+        if(eventfd_read(logfd, &val) < 0)
+        {
+            continue;
+        }
+        unsigned long long flushseq;
+        bool stop;
+        {
+            std::lock_guard<std::mutex> lock(logflushlock);
+            flushseq = logflushseq;
+            stop = logstop;
+        }
+        if(flushseq == logflushdone && !stop) //nobody is waiting, so let more lines pile up
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(LOG_FLUSH_TIME));
+        }
+        for(;;)
+        {
+            int n = 0;
+            logline l;
+            while(loglines.pop(l))
+            {
+                batch.insert(batch.end(), l.text, l.text + l.len);
+                n++;
+            }
+            if(logpending.fetch_sub(n) == n) //the next line logged wakes the writer again
+            {
+                break;
+            }
+            std::this_thread::yield(); //a line is still being pushed
+        }
+        unsigned long long dropped = logdropped.exchange(0);
+        if(dropped)
+        {
+            char line[64];
+            int len = snprintf(line, sizeof(line), "dropped %llu log lines\n", dropped);
+            batch.insert(batch.end(), line, line + len);
+        }
+        if(batch.size())
+        {
+            fwrite(batch.data(), 1, batch.size(), logfile);
+            fflush(logfile);
+            written += batch.size();
+            batch.clear();
+        }
+        if(logname[0] && written >= static_cast<long>(LOG_ROTATE_SIZE))
+        {
+            rotatelog();
+            written = 0;
+        }
+        {
+            std::lock_guard<std::mutex> lock(logflushlock);
+            logflushdone = flushseq;
+        }
+        logflushed.notify_all();
+        if(stop)
+        {
+            return;
+        }
+    }
+}
+
+// hands logfile to the writer thread, which rotates logname unless logfile is not that file
+void setuplog(bool rotate)
+{
+    if(!rotate)
+    {
+        logname[0] = '\0';
+    }
+    logfd = eventfd(0, EFD_CLOEXEC);
+    if(logfd < 0)
+    {
+        return; //lines keep being written straight through
+    }
+    logwriter = std::thread(runlogwriter);
+}
+
+// writes out everything queued and joins the writer, which must be the last thread still logging
+void stoplog()
+{
+    if(logfd < 0)
+    {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(logflushlock);
+        logstop = true;
+    }
+    eventfd_write(logfd, 1);
+    logwriter.join();
+    close(logfd);
+    logfd = -1;
+}
+
+// registers a socket with the reactor once
+bool watchsocket(ENetSocket sock, uint events, unsigned long long id)
+{
+    epoll_event ev;
+    ev.events = events | EPOLLET;
+    ev.data.u64 = id;
+    return epoll_ctl(epollfd, EPOLL_CTL_ADD, sock, &ev) >= 0;
+}
+
+// switches a client between read and write interest, only when its pending output changes
+void updateclient(client &c)
+{
+    bool writing = c.pending();
+    if(writing == c.writing || c.socket == ENET_SOCKET_NULL)
+    {
+        return;
+    }
+    c.writing = writing;
+    epoll_event ev;
+    ev.events = (writing ? EPOLLOUT : EPOLLIN) | EPOLLET;
+    ev.data.u64 = c.handle.id();
+    epoll_ctl(epollfd, EPOLL_CTL_MOD, c.socket, &ev);
 }
 
-void purgeclient(int n)
+// any events still queued for the client resolve to nothing once its handle is removed
+void purgeclient(client &c)
 {
-    client &c = *clients.at(n);
+    if(c.servport >= 0)
+    {
+        gameserver *s = findgameserver(c.address.host, c.servport);
+        if(s && s->owner == &c)
+        {
+            s->owner = nullptr;
+        }
+    }
     if(c.message)
     {
         c.message->purge();
+        c.message = nullptr;
+    }
+    if(c.socket != ENET_SOCKET_NULL) //not handed off
+    {
+        enet_socket_destroy(c.socket);
+    }
+    numclients--;
+    unlinkhostclient(c);
+    if(c.output.capacity() && c.output.capacity() <= OUTPUT_LIMIT && outputpool.size() < OUTPUTPOOL_SIZE)
+    {
+        c.output.clear();
+        outputpool.push_back(std::move(c.output));
     }
-    enet_socket_destroy(c.socket);
-    delete clients.at(n);
-    clients.erase(clients.begin() + n);
+    timers.cancel(c.idletimer);
+    clients.remove(c.handle);
+    clientpool.release(&c);
 }
 
-void output(client &c, const std::string &msg)
+// formats straight onto the end of the client's reply buffer
+void bufferfv(std::vector<char> &buf, const char *fmt, va_list args)
 {
-    c.output.append(msg);
+    int start = buf.size();
+    buf.resize(start + MAXSTRLEN);
+    int len = vsnprintf(&buf[start], MAXSTRLEN, fmt, args);
+    buf.resize(start + std::clamp(len, 0, int(MAXSTRLEN) - 1));
+}
+
+void bufferf(std::vector<char> &buf, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    bufferfv(buf, fmt, args);
+    va_end(args);
 }
 
 void outputf(client &c, const char *fmt, ...)
 {
-    DEFV_FORMAT_STRING(msg, fmt, fmt);
-    std::string out(msg);
-    output(c, out);
+    va_list args;
+    va_start(args, fmt);
+    bufferfv(c.output, fmt, args);
+    va_end(args);
+    updateclient(c);
 }
 
 ENetSocket pingsocket = ENET_SOCKET_NULL;
@@ -180,505 +832,2293 @@ bool setuppingsocket(ENetAddress *address)
     return true;
 }
 
-void setupserver(int port, const char *ip = nullptr)
+// pings are queued as they come due and sent with one sendmmsg per batch, pongs are drained with recvmmsg
+int pingbatch = 64;
+
+struct batchstats
 {
-    time_t starttime;
-    ENetAddress address;
-    address.host = ENET_HOST_ANY;
-    address.port = port;
+    unsigned long long calls, datagrams; //fill ratio is datagrams / (calls * pingbatch)
+};
+batchstats pingstats = {0, 0},
+           pongstats = {0, 0};
 
-    if(ip)
+std::vector<mmsghdr> pingmsgs, pongmsgs;
+std::vector<sockaddr_in> pingaddrs, pongaddrs;
+std::vector<iovec> pongiovs;
+std::vector<uchar> pongbufs;
+iovec pingiov;
+int numqueuedpings = 0;
+
+void setuppingbatch(int size)
+{
+    static uchar ping[] = { 0xFF, 0xFF, 1 };
+    pingbatch = std::clamp(size, 1, int(PINGBATCH_LIMIT));
+    pingiov.iov_base = ping;
+    pingiov.iov_len = sizeof(ping);
+    pingmsgs.assign(pingbatch, mmsghdr());
+    pongmsgs.assign(pingbatch, mmsghdr());
+    pingaddrs.assign(pingbatch, sockaddr_in());
+    pongaddrs.assign(pingbatch, sockaddr_in());
+    pongiovs.assign(pingbatch, iovec());
+    pongbufs.assign(pingbatch * MAXTRANS, 0);
+    for(int i = 0; i < pingbatch; ++i)
     {
-        if(enet_address_set_host(&address, ip)<0)
-        {
-            fatal("failed to resolve server address: %s", ip);
-        }
+        msghdr &ping = pingmsgs[i].msg_hdr;
+        ping.msg_name = &pingaddrs[i];
+        ping.msg_namelen = sizeof(sockaddr_in);
+        ping.msg_iov = &pingiov;
+        ping.msg_iovlen = 1;
+        pongiovs[i].iov_base = &pongbufs[i * MAXTRANS];
+        pongiovs[i].iov_len = MAXTRANS;
+        msghdr &pong = pongmsgs[i].msg_hdr;
+        pong.msg_name = &pongaddrs[i];
+        pong.msg_iov = &pongiovs[i];
+        pong.msg_iovlen = 1;
     }
-    serversocket = enet_socket_create(ENET_SOCKET_TYPE_STREAM);
-    if(serversocket==ENET_SOCKET_NULL)
-    {
-        fatal("failed to bind socket: null socket error");
+}
+
+void flushpings()
+{
+    if(!numqueuedpings)
+    {
+        return;
+    }
+    int sent = 0;
+    while(sent < numqueuedpings)
+    {
+        int res = sendmmsg(pingsocket, &pingmsgs[sent], numqueuedpings - sent, 0);
+        pingstats.calls++;
+        if(res <= 0)
+        {
+            if(res < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            break; //the socket is full, so the rest stay queued for the next flush
+        }
+        sent += res;
+    }
+    pingstats.datagrams += sent;
+    numqueuedpings -= sent;
+    if(sent && numqueuedpings)
+    {
+        memmove(&pingaddrs[0], &pingaddrs[sent], numqueuedpings*sizeof(sockaddr_in));
+    }
+}
+
+void queueping(const ENetAddress &address)
+{
+    if(numqueuedpings >= pingbatch) //still full after a flush that sent nothing, so this ping is lost and retried like one
+    {
+        return;
+    }
+    sockaddr_in &sin = pingaddrs[numqueuedpings++];
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = address.host;
+    sin.sin_port = ENET_HOST_TO_NET_16(address.port);
+    if(numqueuedpings >= pingbatch)
+    {
+        flushpings();
+    }
+}
+
+// pings are spread out to at most pingrate per second, so servers due together do not flood either side
+int pingrate = PING_RATE;
+enet_uint32 pacetime = 0;
+unsigned long long pacedebt = 0; // slots handed out past pacetime, at 1000 per ping while pingrate are paid off every millisecond
+std::minstd_rand pingrng;
+
+// hands out the next free ping slot and returns how many milliseconds away it is
+enet_uint32 pacedelay()
+{
+    unsigned long long repaid = static_cast<unsigned long long>(servtime - pacetime) * pingrate;
+    pacedebt = pacedebt > repaid ? pacedebt - repaid : 0;
+    pacetime = servtime;
+    enet_uint32 delay = pacedebt / pingrate;
+    pacedebt += 1000;
+    return delay;
+}
+
+// moves a delay by up to PING_JITTER percent either way, so servers registered together drift apart
+enet_uint32 jitter(enet_uint32 delay)
+{
+    enet_uint32 spread = delay * PING_JITTER / 100;
+    return spread ? delay - spread + pingrng() % (2*spread + 1) : delay;
+}
+
+ENetSocket setuplistensocket(const ENetAddress &address, bool reuseport)
+{
+    ENetSocket sock = enet_socket_create(ENET_SOCKET_TYPE_STREAM);
+    if(sock==ENET_SOCKET_NULL)
+    {
+        fatal("failed to bind socket: null socket error");
     }
-    if(enet_socket_set_option(serversocket, ENET_SOCKOPT_REUSEADDR, 1) < 0)
+    if(enet_socket_set_option(sock, ENET_SOCKOPT_REUSEADDR, 1) < 0)
     {
         fatal("failed to bind socket: reuseaddr error");
     }
-    if(enet_socket_bind(serversocket, &address) < 0 ||
-       enet_socket_listen(serversocket, -1) < 0)
+    int one = 1;
+    if(reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+    {
+        fatal("failed to bind socket: reuseport error");
+    }
+    if(enet_socket_bind(sock, &address) < 0 ||
+       enet_socket_listen(sock, -1) < 0)
     {
         fatal("failed to bind socket");
     }
-    if(enet_socket_set_option(serversocket, ENET_SOCKOPT_NONBLOCK, 1)<0)
+    if(enet_socket_set_option(sock, ENET_SOCKOPT_NONBLOCK, 1)<0)
     {
         fatal("failed to make server socket non-blocking");
     }
+    return sock;
+}
+
+// creates the calling thread's epoll instance and watches its listening and wakeup sockets
+void setupreactor(int wake)
+{
+    wakefd = wake;
+    epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if(epollfd < 0)
+    {
+        fatal("failed to create epoll instance");
+    }
+    if(!watchsocket(serversocket, EPOLLIN, SERVER_EVENT) || !watchsocket(wakefd, EPOLLIN, WAKE_EVENT))
+    {
+        fatal("failed to watch server sockets");
+    }
+    timers.init(enet_time_get());
+}
+
+void wakeshard(int n)
+{
+    eventfd_write(shardwakefds[n], 1);
+}
+
+void setupserver(int port, const char *ip = nullptr, int numworkers = 0, int pingbatchsize = 64, int adminport = 0)
+{
+    time_t starttime;
+    ENetAddress address;
+    address.host = ENET_HOST_ANY;
+    address.port = port;
+
+    if(ip)
+    {
+        if(enet_address_set_host(&address, ip)<0)
+        {
+            fatal("failed to resolve server address: %s", ip);
+        }
+    }
+    serversocket = setuplistensocket(address, numworkers > 0);
+    for(int i = 0; i < numworkers; ++i)
+    {
+        workersockets.push_back(setuplistensocket(address, true));
+    }
+    for(int i = 0; i <= numworkers; ++i)
+    {
+        int wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(wake < 0)
+        {
+            fatal("failed to create wakeup event");
+        }
+        shardwakefds.push_back(wake);
+    }
     if(!setuppingsocket(&address))
     {
         fatal("failed to create ping socket");
     }
+    setuppingbatch(pingbatchsize);
+    pingrng.seed(getmicros());
     enet_time_set(0);
+    setupreactor(shardwakefds[0]);
+    if(!watchsocket(pingsocket, EPOLLIN, PING_EVENT))
+    {
+        fatal("failed to watch server sockets");
+    }
+    if(adminport)
+    {
+        ENetAddress adminaddress;
+        adminaddress.host = ENET_HOST_TO_NET_32(0x7F000001);
+        adminaddress.port = adminport;
+        adminsocket = setuplistensocket(adminaddress, false);
+        if(!watchsocket(adminsocket, EPOLLIN, ADMIN_EVENT))
+        {
+            fatal("failed to watch admin socket");
+        }
+    }
+    rlimit lim;
+    if(!getrlimit(RLIMIT_NOFILE, &lim) && lim.rlim_cur < lim.rlim_max)
+    {
+        lim.rlim_cur = lim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &lim);
+    }
+    if(!getrlimit(RLIMIT_NOFILE, &lim) && lim.rlim_cur < CLIENT_LIMIT + 16)
+    {
+        logoutf(LOG_WARN, "warning: file descriptor limit %d is below the client limit %d", int(lim.rlim_cur), CLIENT_LIMIT);
+    }
     starttime = time(nullptr);
     char *ct = ctime(&starttime);
     if(strchr(ct, '\n'))
     {
         *strchr(ct, '\n') = '\0';
     }
-    conoutf("*** Starting master server on %s %d at %s ***", ip ? ip : "localhost", port, ct);
+    conoutf("*** Starting master server on %s %d with %d list workers at %s ***", ip ? ip : "localhost", port, numworkers, ct);
+}
+
+void genserverlist()
+{
+    if(!updateserverlist)
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(messagelock);
+    //only the newest list can be unreferenced and alive, so it may be patched in place
+    messagebuf *cur = gameserverlists.size() ? gameserverlists.back() : nullptr,
+               *l = cur && cur->refs<=0 ? cur : new messagebuf(gameserverlists);
+    if(l != cur)
+    {
+        gameserverlists.push_back(l);
+    }
+    //versions start from the clock so a client never catches up across a restart with stale deltas
+    unsigned long long version = cur ? cur->version + 1 : static_cast<unsigned long long>(time(nullptr)) << 20;
+    int holes = serverlistholes;
+    for(uint i = 0; i < pendingholes.size(); i++)
+    {
+        holes += pendingholes[i].len;
+    }
+    if(cur && !rebuildserverlist && holes <= cur->length()/4)
+    {
+        if(l != cur)
+        {
+            l->buf = cur->buf;
+        }
+        l->buf.pop_back();
+        for(uint i = 0; i < pendingholes.size(); i++) //spaces then the newline, which every client skips as an empty line
+        {
+            memset(&l->buf[pendingholes[i].pos], ' ', pendingholes[i].len - 1);
+        }
+        serverlistholes = holes;
+        for(uint i = 0; i < pendinglisted.size(); i++)
+        {
+            gameserver &s = *pendinglisted[i];
+            s.listpos = l->buf.size();
+            l->buf.insert(l->buf.end(), s.listentry, s.listentry + s.listlen);
+        }
+    }
+    else
+    {
+        l->buf.clear();
+        for(uint i = 0; i < gameservers.size(); i++)
+        {
+            gameserver &s = *gameservers[i];
+            if(!s.lastpong)
+            {
+                continue;
+            }
+            s.listpos = l->buf.size();
+            l->buf.insert(l->buf.end(), s.listentry, s.listentry + s.listlen);
+        }
+        serverlistholes = 0;
+    }
+    pendingholes.clear();
+    l->buf.push_back('\0');
+    l->version = version;
+    if(listdeltas.size() >= LISTDELTA_LIMIT)
+    {
+        listdeltas.erase(listdeltas.begin());
+    }
+    listdeltas.emplace_back();
+    listdelta &d = listdeltas.back();
+    d.version = version;
+    d.buf.swap(pendingdelisted);
+    for(uint i = 0; i < pendinglisted.size(); i++)
+    {
+        gameserver &s = *pendinglisted[i];
+        d.buf.insert(d.buf.end(), s.listentry, s.listentry + s.listlen);
+        indexlisted(s);
+    }
+    pendinglisted.clear();
+    invalidatefilteredlists();
+    rebuildserverlist = false;
+    updateserverlist = false;
+    updateserverlistz = true;
+    invalidateserverinfo();
+}
+
+// rebuilds the listinfo reply from the published servers; info changes with every game, so this is batched to INFOLIST_TIME
+void genserverinfolist()
+{
+    if(!updateserverinfo || (serverinfolists.size() && ENET_TIME_DIFFERENCE(servtime, serverinfotime) < INFOLIST_TIME))
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(messagelock);
+    messagebuf *cur = serverinfolists.size() ? serverinfolists.back() : nullptr,
+               *l = cur && cur->refs<=0 ? cur : new messagebuf(serverinfolists);
+    if(l != cur)
+    {
+        serverinfolists.push_back(l);
+    }
+    l->buf.clear();
+    for(uint i = 0; i < hostorder.size(); i++)
+    {
+        gameserver &s = *hostorder[i];
+        l->buf.insert(l->buf.end(), s.listentry, s.listentry + s.listlen);
+        if(!s.hasinfo)
+        {
+            continue;
+        }
+        const serverinfo &info = s.info;
+        char line[INFOENTRY_LEN];
+        int len = snprintf(line, sizeof(line), "serverinfo%.*s %d %d", s.listlen - 10, s.listentry + 9, info.players, info.numattrs);
+        for(int j = 0; j < info.numattrs; j++)
+        {
+            len += snprintf(&line[len], sizeof(line) - len, " %d", info.attrs[j]);
+        }
+        len += snprintf(&line[len], sizeof(line) - len, " \"%s\" \"%s\"\n", info.map, info.desc);
+        l->buf.insert(l->buf.end(), line, line + len);
+    }
+    l->buf.push_back('\0');
+    l->version = gameserverlists.size() ? gameserverlists.back()->version : 0;
+    serverinfotime = servtime;
+    updateserverinfo = false;
+}
+
+void rebuildserverinfo(timer &t)
+{
+    genserverinfolist();
+    if(updateserverinfo) //still within INFOLIST_TIME of the last rebuild
+    {
+        timers.schedule(t, serverinfotime + INFOLIST_TIME);
+    }
+}
+
+// deflates the newest server list for listz, on the first request after it changed; messagelock must be held by lock, which is released while compressing
+void genserverlistz(std::unique_lock<std::mutex> &lock)
+{
+    if(!updateserverlistz || gameserverlists.empty())
+    {
+        return;
+    }
+    messagebuf *src = gameserverlists.back();
+    unsigned long long version = src->version;
+    src->refs++; //pinned, so the registry builds the next list beside it instead of patching it
+    lock.unlock();
+    std::vector<char> buf(compressBound(src->buf.size()));
+    uLongf len = buf.size();
+    if(compress2(reinterpret_cast<Bytef *>(buf.data()), &len, reinterpret_cast<const Bytef *>(src->buf.data()), src->buf.size(), Z_DEFAULT_COMPRESSION) != Z_OK)
+    {
+        len = 0;
+    }
+    buf.resize(len);
+    src->purge();
+    lock.lock();
+    if(gameserverlistsz.size() && gameserverlistsz.back()->version >= version) //another shard got there first
+    {
+        return;
+    }
+    messagebuf *cur = gameserverlistsz.size() ? gameserverlistsz.back() : nullptr,
+               *l = cur && cur->refs<=0 ? cur : new messagebuf(gameserverlistsz);
+    if(l != cur)
+    {
+        gameserverlistsz.push_back(l);
+    }
+    l->buf.swap(buf);
+    l->version = version;
+    if(gameserverlists.back()->version == version)
+    {
+        updateserverlistz = false;
+    }
+}
+
+void printgbans(std::vector<char> &buf, const banlist &b)
+{
+    for(uint i = 0; i < b.size(); i++)
+    {
+        char banstr[260] = "addgban ";
+        int len = strlen(banstr);
+        len += b.masks[i].print(&banstr[len]);
+        banstr[len++] = '\n';
+        buf.insert(buf.end(), banstr, banstr + len);
+    }
+}
+
+// rebuilds the full gban list for servers that just registered or fell behind the log; messagelock must be held
+void genfullgbanlist()
+{
+    if(!updategbanlist && gbanlists.size())
+    {
+        return;
+    }
+    messagebuf *cur = gbanlists.size() ? gbanlists.back() : nullptr,
+               *l = cur && cur->refs<=0 ? cur : new messagebuf(gbanlists);
+    if(l != cur)
+    {
+        gbanlists.push_back(l);
+    }
+    l->buf.clear();
+    bufferf(l->buf, "cleargbans\n");
+    printgbans(l->buf, gbans);
+    l->version = gbanlogversion;
+    updategbanlist = false;
+}
+
+// queues a registered server's next gban log entry, or the full list if it has fallen off the log; messagelock must be held
+void queuegbans(client &c, bool full = false)
+{
+    if(c.message || (!full && (!c.gbancursor || c.gbancursor > gbanlogversion)))
+    {
+        return;
+    }
+    unsigned long long first = gbanlogversion + 1 - gbanlog.size();
+    if(full || c.gbancursor < first)
+    {
+        genfullgbanlist();
+        c.message = gbanlists.back();
+        c.gbancursor = gbanlogversion + 1;
+    }
+    else
+    {
+        c.message = gbanlog[c.gbancursor - first];
+        c.gbancursor++;
+    }
+    c.message->refs++;
+}
+
+// appends a version to the gban log and starts sending it to registered servers that are caught up
+// game servers only know cleargbans and addgban, so removing any ban logs the full list instead
+void loggbans(const banlist &added, const banlist &removed)
+{
+    messagebuf *l = new messagebuf(gbandeltas);
+    if(removed.size())
+    {
+        bufferf(l->buf, "cleargbans\n");
+        printgbans(l->buf, gbans);
+    }
+    else
+    {
+        printgbans(l->buf, added);
+    }
+    std::vector<messagebuf *> trimmed;
+    {
+        std::lock_guard<std::mutex> lock(messagelock);
+        l->version = ++gbanlogversion;
+        l->refs = 1; //held by the log until trimmed
+        gbandeltas.push_back(l);
+        gbanlog.push_back(l);
+        gbanlogbytes += l->length();
+        updategbanlist = true;
+        while(gbanlog.size() > 1 && (gbanlog.size() > GBANLOG_LIMIT || gbanlogbytes > GBANLOG_BYTES))
+        {
+            gbanlogbytes -= gbanlog.front()->length();
+            trimmed.push_back(gbanlog.front());
+            gbanlog.erase(gbanlog.begin());
+        }
+        for(uint i = 0; i < clients.size(); i++)
+        {
+            client &c = *clients[i];
+            if(c.gbancursor && !c.message)
+            {
+                queuegbans(c);
+                updateclient(c);
+            }
+        }
+    }
+    for(uint i = 0; i < trimmed.size(); i++)
+    {
+        trimmed[i]->purge(); //servers still sending it keep it alive
+    }
+}
+
+void genhistogram(std::vector<char> &buf, const char *name, const char *help, const histogram &h)
+{
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    bufferf(buf, "# HELP %s %s\n# TYPE %s summary\n", name, help, name);
+    for(uint i = 0; i < sizeof(quantiles)/sizeof(quantiles[0]); i++)
+    {
+        bufferf(buf, "%s{quantile=\"%g\"} %.6f\n", name, quantiles[i], h.percentile(quantiles[i])/1e6);
+    }
+    bufferf(buf, "%s_sum %.6f\n%s_count %llu\n", name, h.sum()/1e6, name, h.count());
+}
+
+// appends every metric in the Prometheus text format; only called by the registry thread
+void genstats(std::vector<char> &buf)
+{
+    const char *lastname = "";
+    for(int i = 0; i < NUMSTATS; i++)
+    {
+        const statinfo &info = statinfos[i];
+        if(strcmp(info.name, lastname))
+        {
+            bufferf(buf, "# HELP %s %s\n# TYPE %s counter\n", info.name, info.help, info.name);
+            lastname = info.name;
+        }
+        bufferf(buf, info.labels[0] ? "%s{%s} %llu\n" : "%s%s %llu\n", info.name, info.labels, stats[i].load(std::memory_order_relaxed));
+    }
+    bufferf(buf, "# HELP master_ping_datagrams_total ping socket datagrams\n# TYPE master_ping_datagrams_total counter\n"
+                 "master_ping_datagrams_total{dir=\"out\"} %llu\nmaster_ping_datagrams_total{dir=\"in\"} %llu\n",
+                 pingstats.datagrams, pongstats.datagrams);
+    bufferf(buf, "# HELP master_ping_syscalls_total sendmmsg and recvmmsg calls\n# TYPE master_ping_syscalls_total counter\n"
+                 "master_ping_syscalls_total{dir=\"out\"} %llu\nmaster_ping_syscalls_total{dir=\"in\"} %llu\n",
+                 pingstats.calls, pongstats.calls);
+    genhistogram(buf, "master_loop_seconds", "time spent handling one reactor wakeup", loophist);
+    genhistogram(buf, "master_wait_seconds", "time blocked waiting for events", waithist);
+    genhistogram(buf, "master_list_seconds", "time from a list request until the list is fully sent", listhist);
+    genhistogram(buf, "master_ping_rtt_seconds", "game server ping round trips, to the millisecond", pinghist);
+    genhistogram(buf, "master_ping_pacing_seconds", "time pings waited for their slot under pingrate, to the millisecond", pacehist);
+    bufferf(buf, "# HELP master_clients connected clients\n# TYPE master_clients gauge\nmaster_clients %d\n", int(numclients));
+    bufferf(buf, "# HELP master_gameservers registered game servers\n# TYPE master_gameservers gauge\nmaster_gameservers %d\n", int(gameservers.size()));
+    const std::vector<messagebuf *> *messagelists[] = {&gameserverlists, &gameserverlistsz, &filteredlists, &serverinfolists, &gbanlists, &gbandeltas};
+    const char *messagelistnames[] = {"servers", "serversz", "filtered", "serverinfo", "gbans", "gbandeltas"};
+    const int NUMMESSAGELISTS = sizeof(messagelists)/sizeof(messagelists[0]);
+    std::lock_guard<std::mutex> lock(messagelock);
+    bufferf(buf, "# HELP master_gbanlog_bytes size of the gban log registered servers catch up from\n# TYPE master_gbanlog_bytes gauge\n"
+                 "master_gbanlog_bytes %d\n", int(gbanlogbytes));
+    bufferf(buf, "# HELP master_messagebufs shared messages alive\n# TYPE master_messagebufs gauge\n");
+    for(int i = 0; i < NUMMESSAGELISTS; i++)
+    {
+        bufferf(buf, "master_messagebufs{list=\"%s\"} %d\n", messagelistnames[i], int(messagelists[i]->size()));
+    }
+    bufferf(buf, "# HELP master_messagebuf_refs clients still sending a shared message\n# TYPE master_messagebuf_refs gauge\n");
+    for(int i = 0; i < NUMMESSAGELISTS; i++)
+    {
+        int refs = 0;
+        for(uint j = 0; j < messagelists[i]->size(); j++)
+        {
+            refs += (*messagelists[i])[j]->refs;
+        }
+        if(messagelists[i] == &gbandeltas)
+        {
+            refs -= gbanlog.size(); //the log's own refs
+        }
+        else if(messagelists[i] == &filteredlists)
+        {
+            refs -= filteredcache.size(); //the cache's own refs
+        }
+        bufferf(buf, "master_messagebuf_refs{list=\"%s\"} %d\n", messagelistnames[i], refs);
+    }
+}
+
+string statsname;
+enet_uint32 statstime = 0; // milliseconds between dumps of statsname, 0 if disabled
+timer statstimer;
+
+// rewrites master.prom for collectors that scrape files rather than connect to the admin port
+void dumpstats(timer &t)
+{
+    std::vector<char> buf;
+    genstats(buf);
+    DEF_FORMAT_STRING(tmpname, "%s.tmp", statsname);
+    FILE *f = fopen(tmpname, "w");
+    if(f)
+    {
+        bool written = fwrite(buf.data(), 1, buf.size(), f) == buf.size();
+        if(!fclose(f) && written)
+        {
+            rename(tmpname, statsname);
+        }
+    }
+    timers.schedule(t, servtime + statstime);
+}
+
+void checkgameserver(timer &t);
+
+// resets a pooled server to one at address that has never been pinged, listed as hostname
+void initgameserver(gameserver &s, const ENetAddress &address, const char *hostname)
+{
+    s.address = address;
+    s.port = address.port;
+    s.listlen = snprintf(s.listentry, sizeof(s.listentry), "addserver %s %d\n", hostname, s.port);
+    s.listpos = -1;
+    memset(&s.info, 0, sizeof(s.info));
+    s.hasinfo = false;
+    s.numpings = 0;
+    s.lastping = s.lastpong = 0;
+    s.firstping = s.infoping = 0;
+    s.srtt = s.rttvar = -1;
+    s.loss = 0;
+    s.paced = false;
+    s.owner = nullptr;
+    s.pingtimer.expire = checkgameserver;
+    s.pingtimer.owner = &s;
+}
+
+// indexes a server that has not ponged yet and first pings it at pingtime
+gameserver *newgameserver(enet_uint32 host, int port, enet_uint32 pingtime)
+{
+    ENetAddress address;
+    address.host = host;
+    address.port = port;
+    string hostname;
+    if(enet_address_get_host_ip(&address, hostname, sizeof(hostname)) < 0)
+    {
+        return nullptr;
+    }
+    gameserver &s = *gameserverpool.alloc();
+    s.handle = gameservers.add(&s);
+    initgameserver(s, address, hostname);
+    timers.schedule(s.pingtimer, pingtime);
+    gameserverindex.access(serverkey(s.address.host, s.port), &s);
+    gameserverhosts.access(s.address.host, 0)++;
+    return &s;
+}
+
+void addgameserver(client &c)
+{
+    if(gameservers.size() >= SERVER_LIMIT)
+    {
+        return;
+    }
+    gameserver *existing = findgameserver(c.address.host, c.servport);
+    if(existing)
+    {
+        existing->lastping = 0;
+        existing->numpings = 0;
+        existing->owner = &c;
+        timers.schedule(existing->pingtimer, servtime);
+        return;
+    }
+    int *dups = gameserverhosts.find(c.address.host);
+    if(dups && *dups >= static_cast<int>(SERVER_DUP_LIMIT))
+    {
+        outputf(c, "failreg too many servers on ip\n");
+        addstat(STAT_FAILREG_DUP);
+        return;
+    }
+    gameserver *s = newgameserver(c.address.host, c.servport, servtime);
+    if(!s)
+    {
+        outputf(c, "failreg failed resolving ip\n");
+        addstat(STAT_FAILREG_RESOLVE);
+        return;
+    }
+    s->owner = &c;
+}
+
+void servermessage(gameserver &s, const char *msg)
+{
+    if(s.owner)
+    {
+        outputf(*s.owner, msg);
+    }
+}
+
+// reads the engine's compact ints and strings out of a pong
+struct pongreader
+{
+    const uchar *p, *end;
+    bool overread;
+
+    pongreader(const uchar *data, int len) : p(data), end(data + len), overread(false) {}
+
+    int get()
+    {
+        if(p >= end)
+        {
+            overread = true;
+            return 0;
+        }
+        return *p++;
+    }
+
+    int getint()
+    {
+        int c = static_cast<signed char>(get());
+        if(c == -128)
+        {
+            int n = get();
+            return n | static_cast<signed char>(get()) << 8;
+        }
+        if(c == -127)
+        {
+            int n = get();
+            n |= get() << 8;
+            n |= get() << 16;
+            return n | get() << 24;
+        }
+        return c;
+    }
+
+    // keeps only what can go inside a quoted list line, dropping colour codes
+    void getstring(char *buf, int len)
+    {
+        int n = 0;
+        for(int c; (c = getint()) && !overread;)
+        {
+            if(c == '\f')
+            {
+                getint();
+            }
+            else if(c >= ' ' && c < 127 && c != '"' && c != '^' && n < len - 1)
+            {
+                buf[n++] = c;
+            }
+        }
+        buf[n] = '\0';
+    }
+};
+
+// caches the info a server put after the echoed ping, flagging listinfo for a rebuild only if anything changed
+void parseserverinfo(gameserver &s, const uchar *data, int len)
+{
+    static const uchar ping[] = { 0xFF, 0xFF, 1 };
+    if(len < static_cast<int>(sizeof(ping)) || memcmp(data, ping, sizeof(ping)))
+    {
+        return;
+    }
+    pongreader r(data + sizeof(ping), len - sizeof(ping));
+    serverinfo info;
+    memset(&info, 0, sizeof(info));
+    info.players = r.getint();
+    int numattrs = r.getint();
+    for(int i = 0; i < numattrs && !r.overread; i++)
+    {
+        int attr = r.getint();
+        if(i < static_cast<int>(INFO_ATTRS))
+        {
+            info.attrs[info.numattrs++] = attr;
+        }
+    }
+    r.getstring(info.map, sizeof(info.map));
+    r.getstring(info.desc, sizeof(info.desc));
+    if(r.overread || (s.hasinfo && !memcmp(&info, &s.info, sizeof(info))))
+    {
+        return;
+    }
+    s.info = info;
+    s.hasinfo = true;
+    if(s.lastpong)
+    {
+        invalidateserverinfo();
+    }
+}
+
+// folds one answered or missed info ping into the server's loss rate
+void pingloss(gameserver &s, bool lost)
+{
+    s.loss = (7*s.loss + (lost ? 100 : 0))/8;
+}
+
+// folds a round trip into the server's estimate, the same smoothing TCP uses
+void pingrtt(gameserver &s, enet_uint32 sent)
+{
+    int rtt = ENET_TIME_DIFFERENCE(servtime, sent);
+    pinghist.add(rtt*1000ULL);
+    if(s.srtt < 0)
+    {
+        s.srtt = rtt;
+        s.rttvar = rtt/2;
+    }
+    else
+    {
+        s.rttvar = (3*s.rttvar + abs(s.srtt - rtt))/4;
+        s.srtt = (7*s.srtt + rtt)/8;
+    }
+}
+
+void handlepong(const ENetAddress &addr, const uchar *data, int len)
+{
+    gameserver *found = findgameserver(addr.host, addr.port);
+    if(!found)
+    {
+        return;
+    }
+    gameserver &s = *found;
+    parseserverinfo(s, data, len);
+    if(s.lastping && (!s.lastpong || ENET_TIME_GREATER(s.lastping, s.lastpong))) //answers a registration ping, not an info refresh
+    {
+        if(s.numpings == 1) //after a retry it is unknown which ping this answers
+        {
+            pingrtt(s, s.lastping);
+        }
+        client *c = s.owner;
+        if(c)
+        {
+            c->registeredserver = true;
+            outputf(*c, "succreg\n");
+            addstat(STAT_SUCCREG);
+            logoutf(LOG_DEBUG, "registered server %.*s", s.listlen - 11, s.listentry + 10); //without "addserver " and the newline
+            if(!c->gbancursor)
+            {
+                std::lock_guard<std::mutex> lock(messagelock);
+                queuegbans(*c, true);
+                updateclient(*c);
+            }
+        }
+        if(!s.lastpong)
+        {
+            pendinglisted.push_back(&s);
+            updateserverlist = true;
+        }
+        s.lastpong = servtime ? servtime : 1;
+    }
+    else if(s.infoping)
+    {
+        pingloss(s, false);
+        pingrtt(s, s.infoping);
+        s.infoping = 0;
+    }
+}
+
+void checkserverpongs()
+{
+    for(;;)
+    {
+        for(int i = 0; i < pingbatch; ++i)
+        {
+            pongmsgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+        }
+        int n = recvmmsg(pingsocket, pongmsgs.data(), pingbatch, 0, nullptr);
+        if(n <= 0)
+        {
+            if(n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        pongstats.calls++;
+        pongstats.datagrams += n;
+        for(int i = 0; i < n; ++i)
+        {
+            if(pongmsgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+            {
+                continue;
+            }
+            ENetAddress addr;
+            addr.host = pongaddrs[i].sin_addr.s_addr;
+            addr.port = ENET_NET_TO_HOST_16(pongaddrs[i].sin_port);
+            handlepong(addr, &pongbufs[i * MAXTRANS], pongmsgs[i].msg_len);
+        }
+        if(n < pingbatch) //drained, the next datagram raises a new edge
+        {
+            break;
+        }
+    }
+}
+
+void bangameservers(const banlist &b)
+{
+    for(int i = gameservers.size(); --i >=0;) //note reverse iteration
+    {
+        if(b.check(gameservers[i]->address.host))
+        {
+            addstat(STAT_BAN_SERVER);
+            removegameserver(*gameservers[i]);
+        }
+    }
+}
+
+// how long to wait for a registration pong: a few round trips for servers measured before, doubling with every miss
+enet_uint32 pingtimeout(const gameserver &s)
+{
+    if(s.srtt < 0)
+    {
+        return PING_TIME;
+    }
+    int timeout = std::clamp(2*s.srtt + 4*s.rttvar, int(PING_MIN_TIME), int(PING_TIME));
+    return std::min(timeout << std::min(s.numpings - 1, 4), int(PING_TIME));
+}
+
+// runs when a server is due to be pinged, has missed its ping, may have outlived its keepalive or got its pingrate slot
+void checkgameserver(timer &t)
+{
+    gameserver &s = *static_cast<gameserver *>(t.owner);
+    bool answered = s.lastping && s.lastpong && ENET_TIME_LESS_EQUAL(s.lastping, s.lastpong);
+    if(answered)
+    {
+        if(ENET_TIME_DIFFERENCE(servtime, s.lastpong) > KEEPALIVE_TIME)
+        {
+            removegameserver(s);
+            return;
+        }
+        if(s.infoping && !s.paced) //missing it does not count against the server, only towards its loss
+        {
+            pingloss(s, true);
+            addstat(STAT_PING_LOST_INFO);
+            s.infoping = 0;
+        }
+    }
+    else if(s.numpings && !s.paced)
+    {
+        addstat(STAT_PING_LOST_REG);
+        //quick retries for servers that answer quickly, but every server gets as long to answer, and ones lossy while listed longer
+        if(s.numpings >= static_cast<int>(PING_RETRY) && ENET_TIME_DIFFERENCE(servtime, s.firstping) >= PING_RETRY*PING_TIME*(100 + s.loss)/100)
+        {
+            servermessage(s, "failreg failed pinging server\n");
+            addstat(STAT_FAILREG_PING);
+            logoutf(LOG_DEBUG, "dropped server %.*s after %d unanswered pings", s.listlen - 11, s.listentry + 10, s.numpings);
+            removegameserver(s);
+            return;
+        }
+    }
+    if(!s.paced)
+    {
+        enet_uint32 delay = pacedelay();
+        if(delay)
+        {
+            s.paced = true;
+            addstat(STAT_PING_PACED);
+            pacehist.add(delay*1000ULL);
+            timers.schedule(t, servtime + delay);
+            return;
+        }
+    }
+    s.paced = false;
+    queueping(s.address);
+    if(answered)
+    {
+        s.infoping = servtime ? servtime : 1;
+        timers.schedule(t, servtime + jitter(INFO_TIME));
+    }
+    else
+    {
+        if(!s.numpings++)
+        {
+            s.firstping = servtime;
+        }
+        s.lastping = servtime ? servtime : 1;
+        timers.schedule(t, servtime + jitter(pingtimeout(s)) + 1);
+    }
+}
+
+// master.snap is the header followed by one fixed size record per listed server, in native byte order
+struct snapshotheader
+{
+    char magic[4];
+    uint version, numservers, pad;
+    unsigned long long savetime; // unix time the snapshot was written
+};
+
+struct snapshotserver
+{
+    enet_uint32 host;
+    ushort port, pad;
+    enet_uint32 pongage; // milliseconds since the last pong when the snapshot was written
+};
+
+string snapshotname;
+timer snapshottimer;
+
+void savesnapshot()
+{
+    std::vector<snapshotserver> recs;
+    for(uint i = 0; i < gameservers.size(); i++)
+    {
+        gameserver &s = *gameservers[i];
+        if(s.lastpong)
+        {
+            recs.push_back({s.address.host, ushort(s.port), 0, ENET_TIME_DIFFERENCE(servtime, s.lastpong)});
+        }
+    }
+    snapshotheader hdr = {{'M', 'S', 'N', 'P'}, SNAPSHOT_VERSION, uint(recs.size()), 0, static_cast<unsigned long long>(time(nullptr))};
+    DEF_FORMAT_STRING(tmpname, "%s.tmp", snapshotname);
+    FILE *f = fopen(tmpname, "wb");
+    if(f)
+    {
+        bool written = fwrite(&hdr, sizeof(hdr), 1, f) == 1 && fwrite(recs.data(), sizeof(snapshotserver), recs.size(), f) == recs.size();
+        if(!fclose(f) && written)
+        {
+            rename(tmpname, snapshotname);
+        }
+    }
+}
+
+void savesnapshot(timer &t)
+{
+    savesnapshot();
+    timers.schedule(t, servtime + SNAPSHOT_TIME);
+}
+
+// lists the servers saved by the previous run straight away; they stay listed unless they then fail their pings
+void loadsnapshot()
+{
+    int fd = open(snapshotname, O_RDONLY);
+    if(fd < 0)
+    {
+        return;
+    }
+    struct stat st;
+    void *data = fstat(fd, &st) || size_t(st.st_size) < sizeof(snapshotheader) ? MAP_FAILED : mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED)
+    {
+        return;
+    }
+    const snapshotheader &hdr = *static_cast<const snapshotheader *>(data);
+    const snapshotserver *recs = reinterpret_cast<const snapshotserver *>(&hdr + 1);
+    if(memcmp(hdr.magic, "MSNP", 4) || hdr.version != SNAPSHOT_VERSION || hdr.numservers > (st.st_size - sizeof(hdr))/sizeof(snapshotserver))
+    {
+        logoutf(LOG_WARN, "ignoring invalid snapshot %s", snapshotname);
+        munmap(data, st.st_size);
+        return;
+    }
+    unsigned long long now = time(nullptr),
+                       downtime = now > hdr.savetime ? (now - hdr.savetime)*1000 : 0;
+    int restored = 0;
+    for(uint i = 0; i < hdr.numservers && gameservers.size() < SERVER_LIMIT; i++)
+    {
+        const snapshotserver &rec = recs[i];
+        unsigned long long age = rec.pongage + downtime;
+        int *dups = gameserverhosts.find(rec.host);
+        if(age > KEEPALIVE_TIME || findgameserver(rec.host, rec.port) || (dups && *dups >= static_cast<int>(SERVER_DUP_LIMIT)) || checkban(servbans, rec.host))
+        {
+            continue;
+        }
+        //spread the revalidating pings over one ping interval rather than sending them all at once
+        gameserver *s = newgameserver(rec.host, rec.port, servtime + (i*PING_TIME)/hdr.numservers);
+        if(!s)
+        {
+            continue;
+        }
+        s->lastpong = servtime - age;
+        if(!s->lastpong)
+        {
+            s->lastpong = 1;
+        }
+        pendinglisted.push_back(s);
+        updateserverlist = true;
+        restored++;
+    }
+    munmap(data, st.st_size);
+    conoutf("restored %d game servers from %s", restored, snapshotname);
+}
+
+void messagebuf::purge()
+{
+    std::lock_guard<std::mutex> lock(messagelock);
+    refs = std::max(refs - 1, 0);
+    if(refs<=0 && owner.back()!=this)
+    {
+        owner.erase(std::find(owner.begin(), owner.end(), this));
+        delete this;
+    }
+}
+
+// moves a connection to the registry thread; the caller then purges the emptied client
+void handoffclient(client &c, bool charged = false)
+{
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, c.socket, nullptr);
+    {
+        std::lock_guard<std::mutex> lock(handofflock);
+        handoffs.emplace_back();
+        handoff &h = handoffs.back();
+        h.socket = c.socket;
+        h.address = c.address;
+        h.connecttime = c.connecttime;
+        h.lastinput = c.lastinput;
+        h.charged = charged;
+        h.input.assign(c.input + c.inputstart, c.input + c.inputpos);
+    }
+    c.socket = ENET_SOCKET_NULL;
+    wakeshard(0);
+}
+
+// signatures are checked by a fixed pool of threads; jobs and results pass through lock-free queues
+// and an eventfd semaphore lets idle workers sleep until a job is queued
+struct authjob
+{
+    slothandle owner;
+    uint id;
+    uchar pubkey[32], challenge[32], sig[64];
+};
+
+struct authresult
+{
+    slothandle owner;
+    uint id;
+    bool ok;
+};
+
+hashindex<std::string, userkey> users; // only used by the registry thread
+mpmcqueue<authjob, AUTH_QUEUE> authjobs;
+mpmcqueue<authresult, AUTH_QUEUE> authresults;
+int authjobfd = -1;
+std::vector<std::thread> authworkers;
+uint authpending = 0; // jobs queued or being verified, bounded so results can never overflow
+
+bool parsehex(const char *s, int slen, uchar *out, int len)
+{
+    if(slen != 2*len)
+    {
+        return false;
+    }
+    for(int i = 0; i < 2*len; i++)
+    {
+        int c = s[i], val = c >= '0' && c <= '9' ? c - '0' : (c >= 'a' && c <= 'f' ? c - 'a' + 10 : (c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1));
+        if(val < 0)
+        {
+            return false;
+        }
+        out[i/2] = i%2 ? out[i/2] | val : val << 4;
+    }
+    return true;
+}
+
+void printhex(const uchar *data, int len, char *out)
+{
+    for(int i = 0; i < len; i++)
+    {
+        sprintf(&out[2*i], "%02x", data[i]);
+    }
+}
+
+bool verifyauth(EVP_MD_CTX *ctx, const authjob &job)
+{
+    EVP_PKEY *key = EVP_PKEY_new_raw_public_key(EVP_PKEY_ED25519, nullptr, job.pubkey, sizeof(job.pubkey));
+    if(!key)
+    {
+        return false;
+    }
+    bool ok = EVP_DigestVerifyInit(ctx, nullptr, nullptr, nullptr, key) == 1 &&
+              EVP_DigestVerify(ctx, job.sig, sizeof(job.sig), job.challenge, sizeof(job.challenge)) == 1;
+    EVP_MD_CTX_reset(ctx);
+    EVP_PKEY_free(key);
+    return ok;
+}
+
+void runauthworker()
+{
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    while(!stopthreads)
+    {
+        eventfd_t val;
+        authjob job;
+        if(eventfd_read(authjobfd, &val) < 0 || !authjobs.pop(job))
+        {
+            continue;
+        }
+        authresult result = {job.owner, job.id, verifyauth(ctx, job)};
+        authresults.push(result);
+        wakeshard(0);
+    }
+    EVP_MD_CTX_free(ctx);
+}
+
+void setupauth()
+{
+    authjobfd = eventfd(0, EFD_SEMAPHORE | EFD_CLOEXEC);
+    if(authjobfd < 0)
+    {
+        fatal("failed to create auth job semaphore");
+    }
+    for(uint i = 0; i < AUTH_WORKERS; i++)
+    {
+        authworkers.emplace_back(runauthworker);
+    }
+}
+
+void stopauth()
+{
+    eventfd_write(authjobfd, authworkers.size()); //a post for each, as the semaphore hands out one at a time
+    for(uint i = 0; i < authworkers.size(); i++)
+    {
+        authworkers[i].join();
+    }
+    authworkers.clear();
+}
+
+// replies for verified signatures, if the client asking is still connected
+void checkauthresults()
+{
+    authresult result;
+    while(authresults.pop(result))
+    {
+        authpending--;
+        if(client *c = clients.get(result.owner))
+        {
+            outputf(*c, result.ok ? "succauth %u\n" : "failauth %u\n", result.id);
+        }
+    }
+}
+
+void purgeauths(client &c)
+{
+    uint expired = 0;
+    while(expired < c.authreqs.size() && ENET_TIME_DIFFERENCE(servtime, c.authreqs[expired].reqtime) > AUTH_TIME)
+    {
+        expired++;
+    }
+    c.authreqs.erase(c.authreqs.begin(), c.authreqs.begin() + expired);
+}
+
+void reqauth(client &c, uint id, const std::string &name)
+{
+    if(c.lastauth && ENET_TIME_DIFFERENCE(servtime, c.lastauth) < AUTH_THROTTLE)
+    {
+        outputf(c, "failauth %u\n", id);
+        return;
+    }
+    c.lastauth = servtime ? servtime : 1;
+    purgeauths(c);
+    userkey *u = users.find(name);
+    if(!u || c.authreqs.size() >= AUTH_LIMIT)
+    {
+        outputf(c, "failauth %u\n", id);
+        return;
+    }
+    authreq a;
+    a.reqtime = servtime;
+    a.id = id;
+    memcpy(a.pubkey, u->pubkey, sizeof(a.pubkey));
+    if(RAND_bytes(a.challenge, sizeof(a.challenge)) != 1)
+    {
+        outputf(c, "failauth %u\n", id);
+        return;
+    }
+    c.authreqs.push_back(a);
+    char challenge[2*sizeof(a.challenge) + 1];
+    printhex(a.challenge, sizeof(a.challenge), challenge);
+    outputf(c, "chalauth %u %s\n", id, challenge);
+}
+
+// hands the answer to the auth workers, each challenge can only be answered once
+void confauth(client &c, uint id, const char *val, int len)
+{
+    purgeauths(c);
+    for(uint i = 0; i < c.authreqs.size(); i++)
+    {
+        authreq &a = c.authreqs[i];
+        if(a.id != id)
+        {
+            continue;
+        }
+        authjob job;
+        job.owner = c.handle;
+        job.id = id;
+        memcpy(job.pubkey, a.pubkey, sizeof(job.pubkey));
+        memcpy(job.challenge, a.challenge, sizeof(job.challenge));
+        c.authreqs.erase(c.authreqs.begin() + i);
+        if(!parsehex(val, len, job.sig, sizeof(job.sig)) || authpending >= AUTH_QUEUE || !authjobs.push(job))
+        {
+            break;
+        }
+        authpending++;
+        eventfd_write(authjobfd, 1);
+        return;
+    }
+    outputf(c, "failauth %u\n", id);
+}
+
+// a word of a command line, pointing into the client's input
+struct cmdword
+{
+    const char *str;
+    int len;
+
+    bool is(const char *name) const
+    {
+        return len == static_cast<int>(strlen(name)) && !memcmp(str, name, len);
+    }
+};
+
+// splits a line into at most maxwords words separated by spaces or tabs, without copying
+int splitwords(const char *line, int len, cmdword *words, int maxwords)
+{
+    int numwords = 0;
+    for(int i = 0; i < len && numwords < maxwords;)
+    {
+        if(line[i] == ' ' || line[i] == '\t')
+        {
+            i++;
+            continue;
+        }
+        cmdword &w = words[numwords++];
+        w.str = &line[i];
+        while(i < len && line[i] != ' ' && line[i] != '\t')
+        {
+            i++;
+        }
+        w.len = &line[i] - w.str;
+    }
+    return numwords;
+}
+
+// plain decimal that fits in 64 bits
+bool parseuint(const cmdword &w, unsigned long long &val)
+{
+    if(w.len <= 0 || w.len > 19)
+    {
+        return false;
+    }
+    unsigned long long n = 0;
+    for(int i = 0; i < w.len; i++)
+    {
+        if(w.str[i] < '0' || w.str[i] > '9')
+        {
+            return false;
+        }
+        n = n*10 + (w.str[i] - '0');
+    }
+    val = n;
+    return true;
+}
+
+// plain decimal that fits in 32 bits
+bool parseuint(const cmdword &w, uint &val)
+{
+    unsigned long long n;
+    if(!parseuint(w, n) || n > 0xFFFFFFFFULL)
+    {
+        return false;
+    }
+    val = n;
+    return true;
+}
+
+// list [since <version>] [ip <mask>] [port <port>[-<port>]], with the pairs in any order
+// pairs that do not parse are ignored, as older masters ignored anything after list
+struct listquery
+{
+    bool hassince, filtered;
+    unsigned long long since;
+    ipmask ip;
+    uint minport, maxport;
+
+    listquery() : hassince(false), filtered(false), since(0), minport(0), maxport(0xFFFF)
+    {
+        ip.ip = ip.mask = 0;
+    }
+
+    void parse(const cmdword *words, int numwords)
+    {
+        for(int i = 0; i + 1 < numwords; i += 2)
+        {
+            const cmdword &arg = words[i+1];
+            if(words[i].is("since") && parseuint(arg, since))
+            {
+                hassince = true;
+            }
+            else if(words[i].is("ip") && arg.len < static_cast<int>(MAXSTRLEN))
+            {
+                string mask;
+                memcpy(mask, arg.str, arg.len);
+                mask[arg.len] = '\0';
+                ip.parse(mask);
+                filtered = true;
+            }
+            else if(words[i].is("port"))
+            {
+                const char *dash = static_cast<const char *>(memchr(arg.str, '-', arg.len));
+                cmdword lo = {arg.str, dash ? int(dash - arg.str) : arg.len},
+                        hi = dash ? cmdword{dash + 1, int(arg.str + arg.len - dash - 1)} : lo;
+                uint l, h;
+                if(parseuint(lo, l) && parseuint(hi, h) && l <= h && h <= 0xFFFF)
+                {
+                    minport = l;
+                    maxport = h;
+                    filtered = true;
+                }
+            }
+        }
+    }
+
+    bool matches(const gameserver &s) const
+    {
+        return ip.check(s.address.host) && uint(s.port) >= minport && uint(s.port) <= maxport;
+    }
+
+    // equivalent queries share a key, and so a cached list
+    std::string key() const
+    {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%x/%x:%u-%u", ip.ip, ip.mask, minport, maxport);
+        return buf;
+    }
+};
+
+// serializes and caches the listed servers matching a query; messagelock must be held
+// only servers in range of whichever index narrows the query down more are visited
+messagebuf *genfilteredlist(const listquery &q, const std::string &key)
+{
+    if(filteredcache.size() >= FILTERCACHE_LIMIT)
+    {
+        invalidatefilteredlists();
+    }
+    enet_uint32 mask = ENET_NET_TO_HOST_32(q.ip.mask),
+                prefix = 0;
+    for(int i = 31; i >= 0 && mask & (1U << i); i--) //masks like 1.*.3.4 are only ranged by their leading part
+    {
+        prefix |= 1U << i;
+    }
+    enet_uint32 lo = ENET_NET_TO_HOST_32(q.ip.ip) & prefix, hi = lo | ~prefix;
+    auto hostbegin = std::lower_bound(hostorder.begin(), hostorder.end(), lo, [](const gameserver *s, enet_uint32 h) { return ENET_NET_TO_HOST_32(s->address.host) < h; }),
+         hostend = std::upper_bound(hostbegin, hostorder.end(), hi, [](enet_uint32 h, const gameserver *s) { return h < ENET_NET_TO_HOST_32(s->address.host); });
+    auto portbegin = std::lower_bound(portorder.begin(), portorder.end(), q.minport, [](const gameserver *s, uint p) { return uint(s->port) < p; }),
+         portend = std::upper_bound(portbegin, portorder.end(), q.maxport, [](uint p, const gameserver *s) { return p < uint(s->port); });
+    bool byhost = hostend - hostbegin <= portend - portbegin;
+    messagebuf *l = new messagebuf(filteredlists);
+    filteredlists.push_back(l);
+    for(auto i = byhost ? hostbegin : portbegin, end = byhost ? hostend : portend; i != end; ++i)
+    {
+        const gameserver &s = **i;
+        if(q.matches(s))
+        {
+            l->buf.insert(l->buf.end(), s.listentry, s.listentry + s.listlen);
+        }
+    }
+    l->buf.push_back('\0');
+    l->version = gameserverlists.back()->version;
+    l->refs = 1; //held by the cache
+    filteredcache.access(key, l);
+    return l;
+}
+
+// queues the server list changes since a version the client already has; messagelock must be held
+// fails if that version is unknown or too old, or the changes are no smaller than the full list
+bool outputlistdelta(client &c, unsigned long long since)
+{
+    messagebuf &cur = *gameserverlists.back();
+    if(listdeltas.empty() || since > cur.version || since + 1 < listdeltas.front().version)
+    {
+        return false;
+    }
+    uint first = since + 1 - listdeltas.front().version;
+    size_t len = 0;
+    for(uint i = first; i < listdeltas.size(); i++)
+    {
+        len += listdeltas[i].buf.size();
+    }
+    if(len >= std::min(size_t(cur.length()), size_t(OUTPUT_LIMIT/2)))
+    {
+        return false;
+    }
+    size_t start = c.output.size();
+    bufferf(c.output, "listversion %llu\n", cur.version);
+    for(uint i = first; i < listdeltas.size(); i++)
+    {
+        c.output.insert(c.output.end(), listdeltas[i].buf.begin(), listdeltas[i].buf.end());
+    }
+    c.output.push_back('\0');
+    addstat(STAT_LIST_BYTES, c.output.size() - start);
+    return true;
+}
+
+// handles each complete line in order, in place, and returns false if the client should be purged
+// list, listz and stats end the session: their reply is sent after anything earlier lines queued
+// and lines after them are ignored
+bool checkclientinput(client &c)
+{
+    while(c.inputstart < c.inputpos)
+    {
+        char *line = &c.input[c.inputstart],
+             *end = static_cast<char *>(memchr(line, '\n', c.inputpos - c.inputstart));
+        if(!end)
+        {
+            break;
+        }
+        int len = end - line,
+            next = end + 1 - c.input;
+        if(len && line[len-1] == '\r')
+        {
+            len--;
+        }
+        c.lastinput = servtime;
+        cmdword words[8];
+        int numwords = splitwords(line, len, words, 8);
+        if(!numwords)
+        {
+            c.inputstart = next;
+            continue;
+        }
+        const cmdword &cmd = words[0];
+        bool listz = cmd.is("listz");
+        uint val, id;
+        if(c.admin) //only stats is answered, anything else is ignored
+        {
+            if(cmd.is("stats"))
+            {
+                genstats(c.output);
+                updateclient(c);
+                c.shouldpurge = true;
+                c.inputstart = c.inputpos;
+                return true;
+            }
+        }
+        else if(listz || cmd.is("list"))
+        {
+            if(!checkrate(c))
+            {
+                return false;
+            }
+            listquery q;
+            if(!listz)
+            {
+                q.parse(&words[1], numwords - 1);
+            }
+            if(!shard)
+            {
+                genserverlist();
+            }
+            std::unique_lock<std::mutex> lock(messagelock);
+            if(listz)
+            {
+                genserverlistz(lock);
+            }
+            std::vector<messagebuf *> &lists = listz ? gameserverlistsz : gameserverlists;
+            if(lists.empty() || c.message)
+            {
+                return false;
+            }
+            messagebuf *l = lists.back();
+            if(q.filtered) //workers serve cached results, but only the registry can build them
+            {
+                std::string key = q.key();
+                messagebuf **cached = filteredcache.find(key);
+                if(cached)
+                {
+                    l = *cached;
+                }
+                else if(shard)
+                {
+                    lock.unlock();
+                    handoffclient(c, true); //already charged for this line
+                    return false;
+                }
+                else
+                {
+                    l = genfilteredlist(q, key);
+                }
+            }
+            if(q.hassince) //clients that already have a list get only what changed, or a fresh list if that is cheaper
+            {
+                if(!q.filtered && outputlistdelta(c, q.since))
+                {
+                    c.shouldpurge = true;
+                    c.requesttime = getmicros();
+                    c.inputstart = c.inputpos;
+                    addstat(STAT_LIST_DELTA);
+                    return true;
+                }
+                bufferf(c.output, "listversion %llu\nclearservers\n", lists.back()->version);
+            }
+            c.message = l;
+            c.message->refs++;
+            c.messagepos = 0;
+            c.shouldpurge = true;
+            c.requesttime = getmicros();
+            c.inputstart = c.inputpos;
+            addstat(listz ? STAT_LIST_ZLIB : q.filtered ? STAT_LIST_FILTERED : STAT_LIST_PLAIN);
+            return true;
+        }
+        else if(cmd.is("listinfo")) //the list with what each server last said about itself, at most INFOLIST_TIME old
+        {
+            if(!checkrate(c))
+            {
+                return false;
+            }
+            if(!shard)
+            {
+                genserverlist();
+                genserverinfolist();
+            }
+            std::lock_guard<std::mutex> lock(messagelock);
+            if(serverinfolists.empty() || c.message)
+            {
+                return false;
+            }
+            c.message = serverinfolists.back();
+            c.message->refs++;
+            c.messagepos = 0;
+            c.shouldpurge = true;
+            c.requesttime = getmicros();
+            c.inputstart = c.inputpos;
+            addstat(STAT_LIST_INFO);
+            return true;
+        }
+        else if(shard) //anything but list needs the registry thread, which gets this line and the rest
+        {
+            handoffclient(c);
+            return false;
+        }
+        else if(cmd.is("regserv") && numwords >= 2)
+        {
+            if(checkban(servbans, c.address.host))
+            {
+                addstat(STAT_BAN_SERVER);
+                return false;
+            }
+            if(!checkrate(c))
+            {
+                return false;
+            }
+            if(!parseuint(words[1], val) || val > 0xFFFF || (c.servport >= 0 && static_cast<int>(val) != c.servport))
+            {
+                outputf(c, "failreg invalid port\n");
+                addstat(STAT_FAILREG_PORT);
+            }
+            else
+            {
+                c.servport = val;
+                addgameserver(c);
+            }
+        }
+        else if(cmd.is("reqauth") && numwords >= 3 && parseuint(words[1], id))
+        {
+            reqauth(c, id, std::string(words[2].str, words[2].len));
+        }
+        else if(cmd.is("confauth") && numwords >= 3 && parseuint(words[1], id))
+        {
+            confauth(c, id, words[2].str, words[2].len);
+        }
+        c.inputstart = next;
+    }
+    if(c.inputstart >= c.inputpos) //all parsed, so the buffer can be reused from the front for free
+    {
+        c.inputstart = c.inputpos = 0;
+    }
+    return c.inputpos - c.inputstart < static_cast<int>(INPUT_LIMIT);
+}
+
+// input only updates lastinput, so the timer is pushed back lazily when it runs
+void checkclienttimeout(timer &t)
+{
+    client &c = *static_cast<client *>(t.owner);
+    enet_uint32 due = c.lastinput + (c.registeredserver ? KEEPALIVE_TIME : CLIENT_TIME);
+    if(ENET_TIME_LESS(servtime, due))
+    {
+        timers.schedule(t, due);
+    }
+    else
+    {
+        purgeclient(c);
+    }
+}
+
+client *newclient(ENetSocket sock, const ENetAddress &address)
+{
+    client *c = clientpool.alloc();
+    c->address = address;
+    c->socket = sock;
+    c->connecttime = servtime;
+    c->lastinput = servtime;
+    c->handle = clients.add(c);
+    numclients++;
+    linkhostclient(*c);
+    if(outputpool.size())
+    {
+        c->output.swap(outputpool.back());
+        outputpool.pop_back();
+    }
+    c->idletimer.expire = checkclienttimeout;
+    c->idletimer.owner = c;
+    timers.schedule(c->idletimer, servtime + CLIENT_TIME);
+    if(enet_socket_set_option(sock, ENET_SOCKOPT_NONBLOCK, 1) < 0 || !watchsocket(sock, EPOLLIN, c->handle.id()))
+    {
+        purgeclient(*c);
+        return nullptr;
+    }
+    return c;
+}
+
+void acceptclients(ENetSocket listensocket, bool admin = false)
+{
+    for(;;)
+    {
+        ENetAddress address;
+        ENetSocket clientsocket = enet_socket_accept(listensocket, &address);
+        if(clientsocket==ENET_SOCKET_NULL)
+        {
+            break;
+        }
+        if(numclients>=static_cast<int>(CLIENT_LIMIT))
+        {
+            addstat(STAT_REJECT_LIMIT);
+            enet_socket_destroy(clientsocket);
+            continue;
+        }
+        if(!checkrate(address.host)) //before anything is allocated for it
+        {
+            enet_socket_destroy(clientsocket);
+            continue;
+        }
+        if(checkban(bans, address.host))
+        {
+            addstat(STAT_BAN_CLIENT);
+            enet_socket_destroy(clientsocket);
+            continue;
+        }
+        if(counthostclients(address.host, 0) >= static_cast<int>(DUP_LIMIT))
+        {
+            addstat(STAT_REJECT_DUP);
+            client **oldest = hostclients.find(address.host);
+            if(!oldest) //every connection from the host is on another shard, which only that shard may touch
+            {
+                enet_socket_destroy(clientsocket);
+                continue;
+            }
+            purgeclient(**oldest);
+        }
+        addstat(STAT_ACCEPTS);
+        if(client *c = newclient(clientsocket, address))
+        {
+            c->admin = admin;
+        }
+    }
+}
+
+// sends pending replies and message together until both are exhausted or the socket would block
+// returns false if the client should be purged
+bool sendclient(client &c)
+{
+    while(c.pending())
+    {
+        ENetBuffer bufs[2];
+        int numbufs = 0,
+            outputidx = -1,
+            messageidx = -1;
+        if(c.messagepos > 0) //replies queued while a message is partly sent must not split its lines
+        {
+            messageidx = numbufs++;
+        }
+        if(c.output.size())
+        {
+            outputidx = numbufs++;
+            bufs[outputidx].data = &c.output[c.outputpos];
+            bufs[outputidx].dataLength = c.output.size() - c.outputpos;
+        }
+        if(c.message)
+        {
+            if(messageidx < 0)
+            {
+                messageidx = numbufs++;
+            }
+            bufs[messageidx].data = (void *)&c.message->getbuf()[c.messagepos];
+            bufs[messageidx].dataLength = c.message->length() - c.messagepos;
+        }
+        int res = enet_socket_send(c.socket, nullptr, bufs, numbufs);
+        if(res<0)
+        {
+            return false;
+        }
+        if(!res)
+        {
+            break;
+        }
+        for(int i = 0; i < numbufs && res > 0; i++)
+        {
+            int sent = std::min(res, static_cast<int>(bufs[i].dataLength));
+            res -= sent;
+            if(i == outputidx)
+            {
+                c.outputpos += sent;
+                if(c.outputpos >= static_cast<int>(c.output.size()))
+                {
+                    c.output.clear();
+                    c.outputpos = 0;
+                    if(c.requesttime && !c.message) //a list delta, which is sent as a reply and already counted in STAT_LIST_BYTES
+                    {
+                        listhist.add(getmicros() - c.requesttime);
+                        c.requesttime = 0;
+                    }
+                }
+            }
+            else
+            {
+                c.messagepos += sent;
+                if(c.messagepos >= c.message->length())
+                {
+                    if(c.requesttime)
+                    {
+                        addstat(STAT_LIST_BYTES, c.message->length());
+                        listhist.add(getmicros() - c.requesttime);
+                        c.requesttime = 0;
+                    }
+                    c.message->purge();
+                    c.message = nullptr;
+                    c.messagepos = 0;
+                    if(c.gbancursor)
+                    {
+                        std::lock_guard<std::mutex> lock(messagelock);
+                        queuegbans(c);
+                    }
+                }
+            }
+        }
+        if(!c.pending() && c.shouldpurge)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void growinput(client &c)
+{
+    inputbuffer *b = inputpool.alloc();
+    c.inputpos -= c.inputstart;
+    memcpy(b->data, &c.input[c.inputstart], c.inputpos);
+    c.inputstart = 0;
+    c.input = b->data;
+    c.inputsize = INPUT_LIMIT;
 }
 
-void genserverlist()
+// moves a partly received line to the front, only once the end of the buffer is reached
+void compactinput(client &c)
 {
-    if(!updateserverlist)
+    c.inputpos -= c.inputstart;
+    memmove(c.input, &c.input[c.inputstart], c.inputpos);
+    c.inputstart = 0;
+}
+
+// hands the large buffer back once the unparsed remainder is small again
+void shrinkinput(client &c)
+{
+    int len = c.inputpos - c.inputstart;
+    if(c.input == c.inlineinput || len > static_cast<int>(INPUT_INLINE/2))
     {
         return;
     }
-    while(gameserverlists.size() && gameserverlists.back()->refs<=0)
-    {
-        delete gameserverlists.back();
-        gameserverlists.pop_back();
-    }
-    messagebuf *l = new messagebuf(gameserverlists);
-    for(uint i = 0; i < gameservers.size(); i++)
+    memcpy(c.inlineinput, &c.input[c.inputstart], len);
+    inputpool.release(reinterpret_cast<inputbuffer *>(c.input));
+    c.input = c.inlineinput;
+    c.inputstart = 0;
+    c.inputpos = len;
+    c.inputsize = INPUT_INLINE;
+}
+
+// reads input until the socket is drained or a reply is pending; false if the client should be purged
+bool receiveclient(client &c)
+{
+    while(!c.pending())
     {
-        gameserver &s = *gameservers.at(i);
-        if(!s.lastpong)
+        if(c.inputpos >= c.inputsize)
         {
-            continue;
+            if(c.inputstart > 0)
+            {
+                compactinput(c);
+            }
+            else
+            {
+                growinput(c); //a full INPUT_LIMIT line was already refused by checkclientinput
+            }
+        }
+        int res = recv(c.socket, &c.input[c.inputpos], c.inputsize - c.inputpos, 0);
+        if(res<0)
+        {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+        if(!res)
+        {
+            return false;
+        }
+        c.inputpos += res;
+        if(!checkclientinput(c))
+        {
+            return false;
         }
-        DEF_FORMAT_STRING(cmd, "addserver %s %d\n", s.ip, s.port);
-        l->buf.insert(l->buf.end(), std::begin(cmd), std::end(cmd));
+        shrinkinput(c);
     }
-    l->buf.push_back('\0');
-    gameserverlists.push_back(l);
-    updateserverlist = false;
+    return true;
 }
 
-void gengbanlist()
+void handleclient(client &c, uint events)
 {
-    messagebuf *l = new messagebuf(gbanlists);
-    std::string header = "cleargbans\n";
-    l->buf.insert(l->buf.begin(), header.begin(), header.end());
-    std::string cmd = "addgban ";
-    for(uint i = 0; i < gbans.size(); i++)
-    {
-        ipmask &b = gbans.at(i);
-        char banstr[260];
-        b.print(banstr);
-        std::string newban = std::string(cmd).append(banstr);
-        l->buf.insert(l->buf.end(), newban.begin(), newban.end() );
-        l->buf.push_back('\n');
-    }
-    if(gbanlists.size() && gbanlists.back()->equals(*l))
+    if(events & EPOLLERR)
     {
-        delete l;
+        purgeclient(c);
         return;
     }
-    while(gbanlists.size() && gbanlists.back()->refs<=0)
-    {
-        delete gbanlists.back();
-        gbanlists.pop_back();
-    }
-    for(uint i = 0; i < gbanlists.size(); i++)
+    // edge triggered: alternate between flushing replies and reading input until the socket would block
+    for(;;)
     {
-        messagebuf *m = gbanlists[i];
-        if(m->refs > 0 && !m->endswith(*l))
+        if(c.pending())
         {
-            m->concat(*l);
+            if(!sendclient(c))
+            {
+                purgeclient(c);
+                return;
+            }
+            if(c.pending())
+            {
+                break;
+            }
         }
-    }
-    gbanlists.push_back(l);
-    for(uint i = 0; i < clients.size(); i++)
-    {
-        client &c = *clients.at(i);
-        if(c.servport >= 0 && !c.message)
+        if(!receiveclient(c) || c.output.size() > OUTPUT_LIMIT)
         {
-            c.message = l;
-            c.message->refs++;
+            purgeclient(c);
+            return;
+        }
+        if(!c.pending())
+        {
+            break;
         }
     }
+    updateclient(c);
 }
 
-void addgameserver(client &c)
+void adoptclients()
 {
-    if(gameservers.size() >= SERVER_LIMIT)
+    std::vector<handoff> adopted;
     {
-        return;
+        std::lock_guard<std::mutex> lock(handofflock);
+        adopted.swap(handoffs);
     }
-    int dups = 0;
-    for(uint i = 0; i < gameservers.size(); i++)
+    for(uint i = 0; i < adopted.size(); i++)
     {
-        gameserver &s = *gameservers.at(i);
-        if(s.address.host != c.address.host)
+        handoff &h = adopted[i];
+        client *c = newclient(h.socket, h.address);
+        if(!c)
         {
             continue;
         }
-        ++dups;
-        if(s.port == c.servport)
+        c->connecttime = h.connecttime;
+        c->lastinput = h.lastinput;
+        c->ratecharged = h.charged;
+        if(static_cast<int>(h.input.size()) > c->inputsize)
         {
-            s.lastping = 0;
-            s.numpings = 0;
-            return;
+            growinput(*c);
         }
-    }
-    if(dups >= SERVER_DUP_LIMIT)
-    {
-        outputf(c, "failreg too many servers on ip\n");
-        return;
-    }
-    string hostname;
-    if(enet_address_get_host_ip(&c.address, hostname, sizeof(hostname)) < 0)
-    {
-        outputf(c, "failreg failed resolving ip\n");
-        return;
-    }
-    gameservers.push_back(new gameserver);
-    gameserver &s = *gameservers.back();
-    s.address.host = c.address.host;
-    s.address.port = c.servport;
-    copystring(s.ip, hostname);
-    s.port = c.servport;
-    s.numpings = 0;
-    s.lastping = s.lastpong = 0;
-}
-
-client *findclient(gameserver &s)
-{
-    for(uint i = 0; i < clients.size(); i++)
-    {
-        client &c = *clients.at(i);
-        if(s.address.host == c.address.host && s.port == c.servport)
+        c->inputpos = h.input.size();
+        memcpy(c->input, h.input.data(), c->inputpos);
+        if(!checkclientinput(*c))
         {
-            return &c;
+            purgeclient(*c);
+            continue;
         }
+        handleclient(*c, 0);
     }
-    return nullptr;
 }
 
-void servermessage(gameserver &s, const char *msg)
+void banclients();
+void applyconfig();
+
+void wakeup()
 {
-    client *c = findclient(s);
-    if(c)
+    eventfd_t val;
+    eventfd_read(wakefd, &val);
+    if(!shard)
     {
-        outputf(*c, msg);
+        adoptclients();
+        applyconfig();
+        checkauthresults();
     }
+    banclients();
 }
 
-void checkserverpongs()
+void checkclients()
 {
-    ENetBuffer buf;
-    ENetAddress addr;
-    static uchar pong[MAXTRANS];
-    for(;;)
+    static thread_local epoll_event events[MAXEVENTS];
+    unsigned long long waitstart = getmicros();
+    int numevents = epoll_wait(epollfd, events, MAXEVENTS, timers.timeout(servtime));
+    loopstart = getmicros();
+    waithist.add(loopstart - waitstart);
+    servtime = enet_time_get();
+    for(int i = 0; i < numevents; i++)
     {
-        buf.data = pong;
-        buf.dataLength = sizeof(pong);
-        int len = enet_socket_receive(pingsocket, &addr, &buf, 1);
-        if(len <= 0)
+        unsigned long long id = events[i].data.u64;
+        if(id == PING_EVENT)
         {
-            break;
+            checkserverpongs();
         }
-        for(uint i = 0; i < gameservers.size(); i++)
+        else if(id == SERVER_EVENT)
         {
-            gameserver &s = *gameservers.at(i);
-            if(s.address.host == addr.host && s.address.port == addr.port)
-            {
-                if(s.lastping && (!s.lastpong || ENET_TIME_GREATER(s.lastping, s.lastpong)))
-                {
-                    client *c = findclient(s);
-                    if(c)
-                    {
-                        c->registeredserver = true;
-                        outputf(*c, "succreg\n");
-                        if(!c->message && gbanlists.size())
-                        {
-                            c->message = gbanlists.back();
-                            c->message->refs++;
-                        }
-                    }
-                }
-                if(!s.lastpong)
-                {
-                    updateserverlist = true;
-                }
-                s.lastpong = servtime ? servtime : 1;
-                break;
-            }
+            acceptclients(serversocket);
         }
-    }
-}
-
-void bangameservers()
-{
-    for(int i = gameservers.size(); --i >=0;) //note reverse iteration
-    {
-        if(checkban(servbans, gameservers.at(i)->address.host))
+        else if(id == ADMIN_EVENT)
         {
-            delete gameservers.at(i);
-            gameservers.erase(gameservers.begin() + i);
-            updateserverlist = true;
+            acceptclients(adminsocket, true);
         }
-    }
-}
-
-void checkgameservers()
-{
-    ENetBuffer buf;
-    for(uint i = 0; i < gameservers.size(); i++)
-    {
-        gameserver &s = *gameservers.at(i);
-        if(s.lastping && s.lastpong && ENET_TIME_LESS_EQUAL(s.lastping, s.lastpong))
+        else if(id == WAKE_EVENT)
         {
-            if(ENET_TIME_DIFFERENCE(servtime, s.lastpong) > KEEPALIVE_TIME)
-            {
-                delete gameservers.at(i);
-                gameservers.erase(gameservers.begin() + i);
-                i--;
-                updateserverlist = true;
-            }
+            wakeup();
         }
-        else if(!s.lastping || ENET_TIME_DIFFERENCE(servtime, s.lastping) > PING_TIME)
+        else if(client *c = clients.get(slothandle::fromid(id)))
         {
-            if(s.numpings >= PING_RETRY)
-            {
-                servermessage(s, "failreg failed pinging server\n");
-                delete gameservers.at(i);
-                gameservers.erase(gameservers.begin() + i);
-                i--;
-                updateserverlist = true;
-            }
-            else
-            {
-                static const uchar ping[] = { 0xFF, 0xFF, 1 };
-                buf.data = (void *)ping;
-                buf.dataLength = sizeof(ping);
-                s.numpings++;
-                s.lastping = servtime ? servtime : 1;
-                enet_socket_send(pingsocket, &s.address, &buf, 1);
-            }
+            handleclient(*c, events[i].events);
         }
     }
 }
 
-void messagebuf::purge()
-{
-    refs = std::max(refs - 1, 0);
-    if(refs<=0 && owner.back()!=this)
-    {
-        owner.erase(std::find(owner.begin(), owner.end(), this));
-        delete this;
-    }
-}
-
-bool checkclientinput(client &c)
+// drops clients matching the bans added since this shard last looked, or all bans if it missed a reload
+void banclients()
 {
-    if(c.inputpos<0)
+    std::shared_lock<std::shared_mutex> lock(banlock);
+    int version = banversion;
+    if(version == lastbanversion)
     {
-        return true;
+        return;
     }
-    char *end = (char *)memchr(c.input, '\n', c.inputpos);
-    while(end)
+    const banlist &b = version == lastbanversion + 1 ? addedbans : bans;
+    lastbanversion = version;
+    for(int i = clients.size(); --i >=0;) //note reverse iteration
     {
-        *end++ = '\0';
-        c.lastinput = servtime;
-        int port;
-        if(!strncmp(c.input, "list", 4) && (!c.input[4] || c.input[4] == '\n' || c.input[4] == '\r'))
-        {
-            genserverlist();
-            if(gameserverlists.empty() || c.message)
-            {
-                return false;
-            }
-            c.message = gameserverlists.back();
-            c.message->refs++;
-            c.output.clear();
-            c.outputpos = 0;
-            c.shouldpurge = true;
-            return true;
-        }
-        else if(sscanf(c.input, "regserv %d", &port) == 1)
+        if(b.check(clients[i]->address.host))
         {
-            if(checkban(servbans, c.address.host))
-            {
-                return false;
-            }
-            if(port < 0 || port > 0xFFFF || (c.servport >= 0 && port != c.servport))
-            {
-                outputf(c, "failreg invalid port\n");
-            }
-            else
-            {
-                c.servport = port;
-                addgameserver(c);
-            }
+            addstat(STAT_BAN_CLIENT);
+            purgeclient(*clients[i]);
         }
-        c.inputpos = &c.input[c.inputpos] - end;
-        memmove(c.input, end, c.inputpos);
-
-        end = (char *)memchr(c.input, '\n', c.inputpos);
     }
-    return c.inputpos < static_cast<int>(sizeof(c.input));
 }
 
-void checkclients()
+// a parsed config, built off the event loop and handed to the registry thread to swap in
+struct masterconfig
 {
-    ENetSocketSet readset, writeset;
-    ENetSocket maxsock = std::max(serversocket, pingsocket);
-    ENET_SOCKETSET_EMPTY(readset);
-    ENET_SOCKETSET_EMPTY(writeset);
-    ENET_SOCKETSET_ADD(readset, serversocket);
-    ENET_SOCKETSET_ADD(readset, pingsocket);
-    for(uint i = 0; i < clients.size(); i++)
+    bool loaded;
+    int loglevel, pingrate;
+    hashindex<std::string, userkey> users;
+    banlist bans, servbans, gbans;
+    banlist newbans, newservbans, newgbans; // masks that were not in the config being replaced
+    banlist oldgbans; // global bans the config being replaced had and this one does not
+};
+std::atomic<masterconfig *> loadedconfig(nullptr);
+std::thread configloader;
+bool loadingconfig = false;
+volatile sig_atomic_t reloadcfg = 0;
+
+// returns the next word on a config line, which may be quoted, or null at the end of the line or a comment
+char *cfgword(char *&p)
+{
+    p += strspn(p, " \t\r\n");
+    if(!*p || (p[0] == '/' && p[1] == '/'))
     {
-        client &c = *clients.at(i);
-        if(c.message || c.output.size())
-        {
-            ENET_SOCKETSET_ADD(writeset, c.socket);
-        }
-        else
-        {
-            ENET_SOCKETSET_ADD(readset, c.socket);
-        }
-        maxsock = std::max(maxsock, c.socket);
+        return nullptr;
     }
-    if(enet_socketset_select(maxsock, &readset, &writeset, 1000)<=0)
+    char *word = p;
+    if(*p == '"')
     {
-        return;
+        word = ++p;
+        p += strcspn(p, "\"\r\n");
     }
-    if(ENET_SOCKETSET_CHECK(readset, pingsocket))
+    else
     {
-        checkserverpongs();
+        p += strcspn(p, " \t\r\n");
     }
-    if(ENET_SOCKETSET_CHECK(readset, serversocket))
+    if(*p)
     {
-        ENetAddress address;
-        ENetSocket clientsocket = enet_socket_accept(serversocket, &address);
-        if(clients.size()>=CLIENT_LIMIT || checkban(bans, address.host))
+        *p++ = '\0';
+    }
+    return word;
+}
+
+// reads the ban, servban, gban and adduser lines and the loglevel and pingrate settings of cfgname a line at a time
+bool loadconfig(const char *cfgname, masterconfig &cfg)
+{
+    FILE *f = fopen(cfgname, "r");
+    if(!f)
+    {
+        logoutf(LOG_WARN, "could not read %s", cfgname);
+        return false;
+    }
+    char line[MAXSTRLEN];
+    int linenum = 0;
+    while(fgets(line, sizeof(line), f))
+    {
+        linenum++;
+        if(!strchr(line, '\n') && !feof(f))
         {
-            enet_socket_destroy(clientsocket);
+            logoutf(LOG_WARN, "%s:%d: line too long", cfgname, linenum);
+            int ch;
+            do
+            {
+                ch = fgetc(f);
+            } while(ch != '\n' && ch != EOF);
+            continue;
+        }
+        char *p = line,
+             *cmd = cfgword(p);
+        if(!cmd)
+        {
+            continue;
         }
-        else if(clientsocket!=ENET_SOCKET_NULL)
+        char *arg = cfgword(p);
+        if(!strcmp(cmd, "loglevel"))
         {
-            int dups = 0,
-                oldest = -1;
-            for(uint i = 0; i < clients.size(); i++)
+            int level = -1;
+            for(int i = 0; arg && i <= LOG_DEBUG; i++)
             {
-                if(clients.at(i)->address.host == address.host)
+                if(!strcmp(arg, loglevelnames[i]))
                 {
-                    dups++;
-                    if(oldest<0 || clients.at(i)->connecttime < clients.at(oldest)->connecttime)
-                    {
-                        oldest = i;
-                    }
+                    level = i;
                 }
             }
-            if(dups >= DUP_LIMIT)
+            if(level < 0)
+            {
+                logoutf(LOG_WARN, "%s:%d: loglevel needs one of error, warn, info or debug", cfgname, linenum);
+            }
+            else
             {
-                purgeclient(oldest);
+                cfg.loglevel = level;
             }
-            client *c = new client;
-            c->address = address;
-            c->socket = clientsocket;
-            c->connecttime = servtime;
-            c->lastinput = servtime;
-            clients.push_back(c);
+            continue;
         }
-    }
-
-    for(uint i = 0; i < clients.size(); i++)
-    {
-        client &c = *clients.at(i);
-        if((c.message || c.output.size()) && ENET_SOCKETSET_CHECK(writeset, c.socket))
+        if(!strcmp(cmd, "pingrate"))
         {
-            const char *data = c.output.size() ? c.output.data() : c.message->getbuf();
-            int len = c.output.size() ? c.output.size() : c.message->length();
-            ENetBuffer buf;
-            buf.data = (void *)&data[c.outputpos];
-            buf.dataLength = len-c.outputpos;
-            int res = enet_socket_send(c.socket, nullptr, &buf, 1);
-            if(res>=0)
+            int rate = arg ? atoi(arg) : 0;
+            if(rate <= 0)
             {
-                c.outputpos += res;
-                if(c.outputpos>=len)
-                {
-                    if(c.output.size())
-                    {
-                        c.output.clear();
-                    }
-                    else
-                    {
-                        c.message->purge();
-                        c.message = nullptr;
-                    }
-                    c.outputpos = 0;
-                    if(!c.message && c.output.empty() && c.shouldpurge)
-                    {
-                        purgeclient(i--);
-                        continue;
-                    }
-                }
+                logoutf(LOG_WARN, "%s:%d: pingrate needs a positive number of pings per second", cfgname, linenum);
             }
             else
             {
-                purgeclient(i--);
-                continue;
+                cfg.pingrate = rate;
             }
+            continue;
         }
-        if(ENET_SOCKETSET_CHECK(readset, c.socket))
+        if(!strcmp(cmd, "adduser"))
         {
-            ENetBuffer buf;
-            buf.data = &c.input[c.inputpos];
-            buf.dataLength = sizeof(c.input) - c.inputpos;
-            int res = enet_socket_receive(c.socket, nullptr, &buf, 1);
-            if(res>0)
+            char *key = cfgword(p);
+            userkey u;
+            if(!arg || !key || !parsehex(key, strlen(key), u.pubkey, sizeof(u.pubkey)))
             {
-                c.inputpos += res;
-                c.input[std::min(c.inputpos, static_cast<int>(sizeof(c.input)-1))] = '\0';
-                if(!checkclientinput(c))
-                {
-                    purgeclient(i--);
-                    continue;
-                }
+                logoutf(LOG_WARN, "%s:%d: adduser needs a name and a hex ed25519 public key", cfgname, linenum);
             }
             else
             {
-                purgeclient(i--);
-                continue;
+                cfg.users.access(arg, u) = u;
             }
+            continue;
         }
-        if(c.output.size() > OUTPUT_LIMIT)
+        banlist *list = !strcmp(cmd, "ban") ? &cfg.bans :
+                        !strcmp(cmd, "servban") ? &cfg.servbans :
+                        !strcmp(cmd, "gban") ? &cfg.gbans :
+                        nullptr;
+        if(!list)
         {
-            purgeclient(i--);
-            continue;
+            logoutf(LOG_WARN, "%s:%d: unknown command: %s", cfgname, linenum, cmd);
         }
-        if(ENET_TIME_DIFFERENCE(servtime, c.lastinput) >= (c.registeredserver ? KEEPALIVE_TIME : CLIENT_TIME))
+        else if(!arg)
         {
-            purgeclient(i--);
-            continue;
+            logoutf(LOG_WARN, "%s:%d: missing address for %s", cfgname, linenum, cmd);
+        }
+        else
+        {
+            addban(*list, arg);
         }
     }
+    fclose(f);
+    return true;
 }
 
-void banclients()
+// parses and indexes the config, then diffs it against the live bans so applying it only costs a swap
+void loadconfigthread(std::string cfgname)
 {
-    for(int i = clients.size(); --i >=0;) //note reverse iteration
+    masterconfig *cfg = new masterconfig;
+    cfg->loglevel = LOG_INFO;
+    cfg->pingrate = PING_RATE;
+    cfg->loaded = loadconfig(cfgname.c_str(), *cfg);
+    if(cfg->loaded)
+    {
+        cfg->bans.update();
+        cfg->servbans.update();
+        cfg->gbans.update();
+        {
+            std::shared_lock<std::shared_mutex> lock(banlock);
+            cfg->bans.diff(bans, cfg->newbans);
+            cfg->servbans.diff(servbans, cfg->newservbans);
+            cfg->gbans.diff(gbans, cfg->newgbans);
+            gbans.diff(cfg->gbans, cfg->oldgbans);
+        }
+        cfg->newbans.update();
+        cfg->newservbans.update();
+    }
+    loadedconfig = cfg;
+    wakeshard(0);
+}
+
+// swaps in a config finished by loadconfigthread and drops whatever the new bans cover
+void applyconfig()
+{
+    masterconfig *cfg = loadedconfig.exchange(nullptr);
+    if(!cfg)
+    {
+        return;
+    }
+    if(cfg->loaded)
     {
-        if(checkban(bans, clients.at(i)->address.host))
         {
-            purgeclient(i);
+            std::unique_lock<std::shared_mutex> lock(banlock);
+            std::swap(bans, cfg->bans);
+            std::swap(servbans, cfg->servbans);
+            std::swap(gbans, cfg->gbans);
+            std::swap(addedbans, cfg->newbans);
+            ++banversion;
+        }
+        std::swap(users, cfg->users); //pending challenges keep their own copy of the key
+        loglevel = cfg->loglevel;
+        pingrate = cfg->pingrate;
+        conoutf("loaded %d users, %d bans, %d server bans, %d global bans", users.size(), bans.size(), servbans.size(), gbans.size());
+        for(uint i = 1; i < shardwakefds.size(); i++)
+        {
+            wakeshard(i);
         }
+        if(cfg->newservbans.size())
+        {
+            bangameservers(cfg->newservbans);
+        }
+        banclients();
+        if(cfg->newgbans.size() || cfg->oldgbans.size())
+        {
+            loggbans(cfg->newgbans, cfg->oldgbans);
+        }
+    }
+    delete cfg; //frees the replaced lists
+    loadingconfig = false;
+}
+
+void reloadconfig(const char *cfgname)
+{
+    if(loadingconfig)
+    {
+        return; //picked up again once the current load is applied
+    }
+    conoutf("reloading %s", cfgname);
+    reloadcfg = 0;
+    loadingconfig = true;
+    if(configloader.joinable()) //done with the last load, which has been applied
+    {
+        configloader.join();
+    }
+    configloader = std::thread(loadconfigthread, std::string(cfgname));
+}
+
+void reloadsignal(int)
+{
+    int err = errno;
+    reloadcfg = 1;
+    eventfd_write(shardwakefds[0], 1);
+    errno = err;
+}
+
+volatile sig_atomic_t quitserver = 0;
+
+void quitsignal(int)
+{
+    int err = errno;
+    quitserver = 1;
+    eventfd_write(shardwakefds[0], 1);
+    errno = err;
+}
+
+void runworker(int n)
+{
+    shard = n;
+    serversocket = workersockets[n-1];
+    setupreactor(shardwakefds[n]);
+    lastbanversion = banversion;
+    while(!stopthreads)
+    {
+        servtime = enet_time_get();
+        checkclients();
+        timers.advance(servtime);
+        loophist.add(getmicros() - loopstart);
     }
 }
 
+#ifndef MASTER_NOMAIN // microbench.cpp includes this file to drive its internals directly
 int main(int argc, char **argv)
 {
-    int reloadcfg = 1;
     if(enet_initialize()<0)
     {
         fatal("Unable to initialise network module");
     }
     atexit(enet_deinitialize);
     const char *dir = "", *ip = nullptr;
-    int port = 42068;
+    int port = 42068,
+        numworkers = 0,
+        pingbatchsize = 64,
+        adminport = 0;
     if(argc>=2)
     {
         dir = argv[1];
@@ -691,33 +3131,98 @@ int main(int argc, char **argv)
     {
         ip = argv[3];
     }
-    DEF_FORMAT_STRING(logname, "%smaster.log", dir);
+    if(argc>=5)
+    {
+        numworkers = std::clamp(atoi(argv[4]), 0, 64);
+    }
+    if(argc>=6)
+    {
+        pingbatchsize = atoi(argv[5]);
+    }
+    if(argc>=7)
+    {
+        adminport = atoi(argv[6]);
+    }
+    if(argc>=8)
+    {
+        statstime = std::max(atoi(argv[7]), 0)*1000;
+    }
+    formatstring(logname, "%smaster.log", dir);
     DEF_FORMAT_STRING(cfgname, "%smaster.cfg", dir);
     path(logname);
     path(cfgname);
+    formatstring(statsname, "%smaster.prom", dir);
+    path(statsname);
+    formatstring(snapshotname, "%smaster.snap", dir);
+    path(snapshotname);
     logfile = fopen(logname, "a");
     if(!logfile)
     {
         logfile = stdout;
     }
-    setvbuf(logfile, nullptr, _IOLBF, BUFSIZ);
-    setupserver(port, ip);
-    for(;;)
+    setupserver(port, ip, numworkers, pingbatchsize, adminport); //most fatal errors happen here, before any thread runs
+    setuplog(logfile != stdout);
+    setupauth();
+    loadconfigthread(cfgname); //nothing to stall yet, so the first load runs inline
+    applyconfig();
+    loadsnapshot();
+    genserverlist();
+    genserverinfolist();
+    if(statstime)
+    {
+        statstimer.expire = dumpstats;
+        timers.schedule(statstimer, servtime + statstime);
+    }
+    snapshottimer.expire = savesnapshot;
+    timers.schedule(snapshottimer, servtime + SNAPSHOT_TIME);
+    serverinfotimer.expire = rebuildserverinfo;
+    struct sigaction sa = {};
+    sa.sa_handler = reloadsignal;
+    sigaction(SIGHUP, &sa, nullptr);
+    sa.sa_handler = quitsignal;
+    sigaction(SIGTERM, &sa, nullptr);
+    sigaction(SIGINT, &sa, nullptr);
+    std::vector<std::thread> workers;
+    for(int i = 1; i <= numworkers; ++i)
+    {
+        workers.emplace_back(runworker, i);
+    }
+    while(!quitserver)
     {
         if(reloadcfg)
         {
-            conoutf("reloading %s", cfgname);
-            //execfile(cfgname);
-            bangameservers();
-            banclients();
-            gengbanlist();
-            reloadcfg = 0;
+            reloadconfig(cfgname);
         }
         servtime = enet_time_get();
         checkclients();
-        checkgameservers();
+        timers.advance(servtime);
+        flushpings();
+        if(numworkers)
+        {
+            genserverlist(); //workers can only serve what the registry has published
+        }
+        loophist.add(getmicros() - loopstart);
     }
-
+    //nothing may outlive main, as the pools and lists every thread uses are destroyed after it returns
+    stopthreads = true;
+    for(int i = 1; i <= numworkers; ++i)
+    {
+        wakeshard(i);
+    }
+    for(uint i = 0; i < workers.size(); i++)
+    {
+        workers[i].join();
+    }
+    stopauth();
+    if(configloader.joinable())
+    {
+        configloader.join();
+    }
+    delete loadedconfig.exchange(nullptr);
+    servtime = enet_time_get();
+    savesnapshot();
+    conoutf("*** Stopping master server, saved %s ***", snapshotname);
+    stoplog();
     return EXIT_SUCCESS;
 }
-
+#endif
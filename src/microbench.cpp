@@ -0,0 +1,204 @@
+// microbenchmarks for tools.cpp and the list, ban and input primitives of master.cpp
+// every result is printed as one JSON object per line so runs can be diffed or fed to a tracker
+
+#define MASTER_NOMAIN
+#include "master.cpp"
+
+#include <random>
+
+constexpr int NUMBANS = 10000;
+constexpr int NUMSERVERS = 5000;
+constexpr int NUMLINES = 100;                            // pipelined lines per checkclientinput call
+constexpr unsigned long long BENCH_TIME = 200000;        // microseconds each benchmark is repeated for
+
+std::vector<std::string> masknames;
+std::vector<ipmask> masks;
+std::vector<enet_uint32> hosts;
+std::vector<char> inputlines;
+client *benchclient = nullptr;
+volatile int sink = 0; // results are folded in here so the work cannot be optimized away
+
+void setupmasks()
+{
+    std::mt19937 rng(1);
+    for(int i = 0; i < NUMBANS; i++)
+    {
+        uint a = rng()%223 + 1, b = rng()&0xFF, c = rng()&0xFF, d = rng()&0xFF;
+        char name[32];
+        switch(i%4) //mostly prefixes, as real configs are, with some hosts and wildcards
+        {
+            case 0: snprintf(name, sizeof(name), "%u.%u.%u.%u", a, b, c, d); break;
+            case 1: snprintf(name, sizeof(name), "%u.%u.%u.0/24", a, b, c); break;
+            case 2: snprintf(name, sizeof(name), "%u.%u.0.0/16", a, b); break;
+            default: snprintf(name, sizeof(name), "%u.%u.*.*", a, b); break;
+        }
+        masknames.push_back(name);
+        ipmask m;
+        m.parse(name);
+        masks.push_back(m);
+        bans.add(m);
+        gbans.add(m);
+    }
+    bans.update();
+    gbans.update();
+    for(int i = 0; i < NUMBANS; i++)
+    {
+        hosts.push_back(rng());
+    }
+}
+
+void setupservers()
+{
+    timers.init(0);
+    for(int i = 0; i < NUMSERVERS; i++)
+    {
+        gameserver &s = *gameserverpool.alloc();
+        s.handle = gameservers.add(&s);
+        ENetAddress address;
+        address.host = ENET_HOST_TO_NET_32(0x0A000000 | i);
+        address.port = 28785;
+        char hostname[32];
+        snprintf(hostname, sizeof(hostname), "10.0.%d.%d", (i>>8)&0xFF, i&0xFF);
+        initgameserver(s, address, hostname);
+        s.lastping = s.lastpong = 1; //already ponged, so every server is listed
+        gameserverindex.access(serverkey(s.address.host, s.port), &s);
+    }
+}
+
+void setupinput()
+{
+    benchclient = clientpool.alloc();
+    benchclient->handle = clients.add(benchclient);
+    benchclient->socket = ENET_SOCKET_NULL; //never touches the reactor
+    benchclient->address.host = ENET_HOST_TO_NET_32(0x7F000001);
+    growinput(*benchclient);
+    for(int i = 0; i < NUMLINES; i++)
+    {
+        const char *line = i%2 ? "regserv 28785\n" : "unknown command ignored by the master\n";
+        inputlines.insert(inputlines.end(), line, line + strlen(line));
+    }
+}
+
+void benchparse()
+{
+    for(uint i = 0; i < masknames.size(); i++)
+    {
+        ipmask m;
+        m.parse(masknames[i].c_str());
+        sink += m.ip;
+    }
+}
+
+void benchprint()
+{
+    for(uint i = 0; i < masks.size(); i++)
+    {
+        char buf[MAXSTRLEN];
+        sink += masks[i].print(buf);
+    }
+}
+
+void benchpath()
+{
+    for(int i = 0; i < NUMBANS; i++)
+    {
+        char buf[] = "packages\\base/./maps/../config/master.cfg";
+        sink += strlen(path(buf));
+    }
+}
+
+void benchcheckban()
+{
+    for(uint i = 0; i < hosts.size(); i++)
+    {
+        sink += checkban(bans, hosts[i]);
+    }
+}
+
+void benchserverlist()
+{
+    rebuildserverlist = updateserverlist = true; //full rebuild, as when the list is compacted
+    genserverlist();
+    sink += gameserverlists.back()->length();
+}
+
+void benchgbanlist()
+{
+    std::lock_guard<std::mutex> lock(messagelock);
+    updategbanlist = true; //full rebuild, as after a reload changed the gbans
+    genfullgbanlist();
+    sink += gbanlists.back()->length();
+}
+
+void benchinput()
+{
+    client &c = *benchclient;
+    memcpy(c.input, inputlines.data(), inputlines.size());
+    c.inputstart = 0;
+    c.inputpos = inputlines.size();
+    sink += checkclientinput(c);
+    c.output.clear();
+}
+
+void resetrates() //every run gets a full burst, so no regserv is rejected before its port is parsed and looked up
+{
+    hostrates.clear();
+    subnetrates.clear();
+}
+
+struct microbench
+{
+    const char *name;
+    int items; //units of work per run
+    void (*run)();
+    void (*reset)(); //untimed, before every run
+};
+
+const microbench microbenches[] =
+{
+    {"ipmask_parse", NUMBANS, benchparse, nullptr},
+    {"ipmask_print", NUMBANS, benchprint, nullptr},
+    {"path", NUMBANS, benchpath, nullptr},
+    {"checkban", NUMBANS, benchcheckban, nullptr},
+    {"genserverlist", NUMSERVERS, benchserverlist, nullptr},
+    {"genfullgbanlist", NUMBANS, benchgbanlist, nullptr},
+    {"checkclientinput", NUMLINES, benchinput, resetrates}
+};
+
+int main(int argc, char **argv)
+{
+    logfile = stderr;
+    setupmasks();
+    setupservers();
+    setupinput();
+    for(const microbench &b : microbenches)
+    {
+        if(argc > 1 && strcmp(argv[1], b.name)) //optionally run just the named benchmark
+        {
+            continue;
+        }
+        if(b.reset)
+        {
+            b.reset();
+        }
+        b.run(); //warm up caches and lazily built state
+        unsigned long long best = ~0ULL, total = 0;
+        int runs = 0;
+        while(total < BENCH_TIME || runs < 5)
+        {
+            if(b.reset)
+            {
+                b.reset();
+            }
+            unsigned long long runstart = getmicros();
+            b.run();
+            unsigned long long elapsed = getmicros() - runstart;
+            best = std::min(best, elapsed);
+            total += elapsed;
+            runs++;
+        }
+        printf("{\"name\":\"%s\",\"items\":%d,\"runs\":%d,\"best_ns_per_item\":%.2f,\"mean_ns_per_item\":%.2f}\n",
+               b.name, b.items, runs, best*1000.0/b.items, total*1000.0/(double(runs)*b.items));
+    }
+    return EXIT_SUCCESS;
+}
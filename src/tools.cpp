@@ -70,3 +70,418 @@ int ipmask::print(char *buf) const
     return int(buf-start);
 }
 
+void banlist::add(const ipmask &m)
+{
+    masks.push_back(m);
+    dirty = true;
+}
+
+void banlist::add(const char *name)
+{
+    ipmask m;
+    m.parse(name);
+    add(m);
+}
+
+void banlist::clear()
+{
+    masks.clear();
+    ranges.clear();
+    irregular.clear();
+    dirty = false;
+}
+
+void banlist::build()
+{
+    ranges.clear();
+    irregular.clear();
+    for(uint i = 0; i < masks.size(); ++i)
+    {
+        const ipmask &m = masks[i];
+        if(m.ip & ~m.mask) //can never match
+        {
+            continue;
+        }
+        enet_uint32 hostmask = ENET_NET_TO_HOST_32(m.mask),
+                    wild = ~hostmask;
+        if(wild & (wild + 1)) //not a prefix
+        {
+            irregular.push_back(m);
+            continue;
+        }
+        range r;
+        r.lo = ENET_NET_TO_HOST_32(m.ip);
+        r.hi = r.lo | wild;
+        ranges.push_back(r);
+    }
+    std::sort(ranges.begin(), ranges.end(), [](const range &a, const range &b) { return a.lo < b.lo; });
+    uint merged = 0;
+    for(uint i = 0; i < ranges.size(); ++i)
+    {
+        if(merged && (ranges[merged-1].hi == 0xFFFFFFFFU || ranges[i].lo <= ranges[merged-1].hi + 1))
+        {
+            ranges[merged-1].hi = std::max(ranges[merged-1].hi, ranges[i].hi);
+        }
+        else
+        {
+            ranges[merged++] = ranges[i];
+        }
+    }
+    ranges.resize(merged);
+    dirty = false;
+}
+
+void banlist::update()
+{
+    if(dirty)
+    {
+        build();
+    }
+}
+
+static bool maskless(const ipmask &a, const ipmask &b)
+{
+    return a.ip < b.ip || (a.ip == b.ip && a.mask < b.mask);
+}
+
+void banlist::diff(const banlist &old, banlist &added) const
+{
+    std::vector<ipmask> cur(masks), prev(old.masks);
+    std::sort(cur.begin(), cur.end(), maskless);
+    std::sort(prev.begin(), prev.end(), maskless);
+    uint j = 0;
+    for(uint i = 0; i < cur.size(); ++i)
+    {
+        if(i && !maskless(cur[i-1], cur[i])) //duplicate
+        {
+            continue;
+        }
+        while(j < prev.size() && maskless(prev[j], cur[i]))
+        {
+            j++;
+        }
+        if(j >= prev.size() || maskless(cur[i], prev[j]))
+        {
+            added.add(cur[i]);
+        }
+    }
+}
+
+bool banlist::check(enet_uint32 host) const
+{
+    assert(!dirty);
+    enet_uint32 h = ENET_NET_TO_HOST_32(host);
+    auto r = std::upper_bound(ranges.begin(), ranges.end(), h, [](enet_uint32 h, const range &r) { return h < r.lo; });
+    if(r != ranges.begin() && h <= (r-1)->hi)
+    {
+        return true;
+    }
+    for(uint i = 0; i < irregular.size(); ++i)
+    {
+        if(irregular[i].check(host))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+///////////////////////// histograms ///////////////////////
+
+histogram::histogram() : total(0), valuesum(0)
+{
+    for(int i = 0; i < NUMBUCKETS; ++i)
+    {
+        buckets[i] = 0;
+    }
+}
+
+int histogram::bucket(unsigned long long v)
+{
+    if(v < static_cast<unsigned long long>(SUBBUCKETS))
+    {
+        return v;
+    }
+    int shift = 63 - __builtin_clzll(v) - SUBBITS; //keeps the top SUBBITS+1 bits
+    return (shift + 1)*SUBBUCKETS + ((v >> shift) & (SUBBUCKETS-1));
+}
+
+unsigned long long histogram::bucketmax(int b)
+{
+    if(b < SUBBUCKETS)
+    {
+        return b;
+    }
+    int shift = b/SUBBUCKETS - 1;
+    unsigned long long lo = static_cast<unsigned long long>(SUBBUCKETS + b%SUBBUCKETS) << shift;
+    return lo + ((1ULL << shift) - 1);
+}
+
+void histogram::add(unsigned long long v)
+{
+    buckets[bucket(v)].fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(1, std::memory_order_relaxed);
+    valuesum.fetch_add(v, std::memory_order_relaxed);
+}
+
+unsigned long long histogram::count() const
+{
+    return total.load(std::memory_order_relaxed);
+}
+
+unsigned long long histogram::sum() const
+{
+    return valuesum.load(std::memory_order_relaxed);
+}
+
+unsigned long long histogram::percentile(double p) const
+{
+    unsigned long long counts[NUMBUCKETS], n = 0;
+    for(int i = 0; i < NUMBUCKETS; ++i) //snapshot, so concurrent adds cannot push the rank past the end
+    {
+        counts[i] = buckets[i].load(std::memory_order_relaxed);
+        n += counts[i];
+    }
+    if(!n)
+    {
+        return 0;
+    }
+    unsigned long long rank = std::max(1ULL, static_cast<unsigned long long>(p*n + 0.5)),
+                       seen = 0;
+    for(int i = 0; i < NUMBUCKETS; ++i)
+    {
+        seen += counts[i];
+        if(seen >= rank)
+        {
+            return bucketmax(i);
+        }
+    }
+    return bucketmax(NUMBUCKETS-1);
+}
+
+///////////////////////// rate limiting ///////////////////////
+
+ratelimiter::ratelimiter(uint rate, uint burst, uint size) : entries(size), rate(rate), burst(burst*1000)
+{
+}
+
+bool ratelimiter::allow(uint key, uint time)
+{
+    uint first = hashkey(key) & (entries.size() - WAYS);
+    std::lock_guard<std::mutex> lock(locks[(first / WAYS) & (LOCKS - 1)]);
+    entry *set = &entries[first],
+          *e = nullptr;
+    for(uint i = 0; i < WAYS; ++i)
+    {
+        if(set[i].used && set[i].key == key)
+        {
+            e = &set[i];
+            break;
+        }
+    }
+    if(!e)
+    {
+        e = &set[0];
+        for(uint i = 1; i < WAYS && e->used; ++i)
+        {
+            if(!set[i].used || static_cast<int>(set[i].last - e->last) < 0)
+            {
+                e = &set[i];
+            }
+        }
+        e->key = key;
+        e->last = time;
+        e->tokens = burst;
+        e->used = true;
+    }
+    else if(static_cast<int>(time - e->last) > 0) //callers sample the clock separately, so time can be slightly behind
+    {
+        unsigned long long refill = static_cast<unsigned long long>(time - e->last)*rate; //thousandths of a token per millisecond
+        e->tokens = static_cast<uint>(std::min(e->tokens + refill, static_cast<unsigned long long>(burst)));
+        e->last = time;
+    }
+    if(e->tokens < 1000)
+    {
+        return false;
+    }
+    e->tokens -= 1000;
+    return true;
+}
+
+void ratelimiter::clear()
+{
+    for(uint i = 0; i < entries.size(); i += WAYS)
+    {
+        std::lock_guard<std::mutex> lock(locks[(i / WAYS) & (LOCKS - 1)]);
+        for(uint j = 0; j < WAYS; ++j)
+        {
+            entries[i + j].used = false;
+        }
+    }
+}
+
+///////////////////////// timers ///////////////////////
+
+static void unlinktimer(timer &t)
+{
+    t.prev->next = t.next;
+    t.next->prev = t.prev;
+    t.prev = t.next = nullptr;
+}
+
+static void linktimer(timer &head, timer &t)
+{
+    t.prev = head.prev;
+    t.next = &head;
+    head.prev->next = &t;
+    head.prev = &t;
+}
+
+timerwheel::timerwheel() : current(0), base(0), count(0)
+{
+    for(int i = 0; i < LEVELS; ++i)
+    {
+        for(int j = 0; j < SLOTS; ++j)
+        {
+            slots[i][j].prev = slots[i][j].next = &slots[i][j];
+        }
+    }
+}
+
+void timerwheel::init(uint time)
+{
+    base = time;
+}
+
+void timerwheel::place(timer &t)
+{
+    uint delta = t.tick - current;
+    if(delta >= (1U<<31)) //overdue
+    {
+        t.tick = current;
+        delta = 0;
+    }
+    for(int level = 0; level < LEVELS; ++level)
+    {
+        int shift = level*SLOTBITS;
+        if(level == LEVELS-1 || delta < (1U<<(shift+SLOTBITS)))
+        {
+            //beyond the top level's range, park the timer in the furthest slot to be placed again later
+            uint tick = level == LEVELS-1 && delta >= (1U<<(shift+SLOTBITS)) ? current + (1U<<(shift+SLOTBITS)) - 1 : t.tick;
+            linktimer(slots[level][(tick>>shift)&(SLOTS-1)], t);
+            return;
+        }
+    }
+}
+
+void timerwheel::schedule(timer &t, uint deadline)
+{
+    if(t.scheduled())
+    {
+        unlinktimer(t);
+    }
+    else
+    {
+        count++;
+    }
+    int delay = std::max(int(deadline - base), 0);
+    t.tick = current + (uint(delay)>>TICKBITS);
+    place(t);
+}
+
+void timerwheel::cancel(timer &t)
+{
+    if(t.scheduled())
+    {
+        unlinktimer(t);
+        count--;
+    }
+}
+
+void timerwheel::cascade(int level)
+{
+    timer &head = slots[level][(current>>(level*SLOTBITS))&(SLOTS-1)];
+    while(head.next != &head)
+    {
+        timer &t = *head.next;
+        unlinktimer(t);
+        place(t);
+    }
+}
+
+void timerwheel::advance(uint time)
+{
+    while(int(time - base) >= TICK)
+    {
+        if(!count)
+        {
+            uint ticks = (time - base)>>TICKBITS;
+            current += ticks;
+            base += ticks<<TICKBITS;
+            return;
+        }
+        int levels = 1;
+        while(levels < LEVELS && !(current & ((1U<<(levels*SLOTBITS))-1)))
+        {
+            levels++;
+        }
+        for(int level = levels; --level > 0;) //note reverse iteration, higher levels fill the lower ones
+        {
+            cascade(level);
+        }
+        timer due;
+        due.prev = due.next = &due;
+        timer &head = slots[0][current&(SLOTS-1)];
+        while(head.next != &head)
+        {
+            timer &t = *head.next;
+            unlinktimer(t);
+            linktimer(due, t);
+        }
+        current++;
+        base += TICK;
+        //expiry may cancel or reschedule any timer, so take them off the list one at a time
+        while(due.next != &due)
+        {
+            timer &t = *due.next;
+            unlinktimer(t);
+            count--;
+            t.expire(t);
+        }
+    }
+}
+
+int timerwheel::timeout(uint time) const
+{
+    if(!count)
+    {
+        return -1;
+    }
+    uint next = ~0U;
+    for(int k = 0; k < SLOTS; ++k)
+    {
+        const timer &head = slots[0][(current+k)&(SLOTS-1)];
+        if(head.next != &head)
+        {
+            next = k;
+            break;
+        }
+    }
+    for(int level = 1; level < LEVELS; ++level)
+    {
+        int shift = level*SLOTBITS;
+        uint start = current>>shift;
+        //the slot at start is still waiting to be cascaded if its first tick has not been expired yet
+        for(int k = current & ((1U<<shift)-1) ? 1 : 0; k <= SLOTS; ++k)
+        {
+            const timer &head = slots[level][(start+k)&(SLOTS-1)];
+            if(head.next != &head)
+            {
+                next = std::min(next, ((start+k)<<shift) - current); //slot is cascaded when its first tick comes up
+                break;
+            }
+        }
+    }
+    int wait = int(base + ((next+1)<<TICKBITS) - time);
+    return std::max(wait, 0);
+}
@@ -104,6 +104,488 @@ static inline char *path(char *s)
     return s;
 }
 
+inline uint hashkey(uint k)
+{
+    k ^= k >> 16;
+    k *= 0x85EBCA6BU;
+    k ^= k >> 13;
+    k *= 0xC2B2AE35U;
+    k ^= k >> 16;
+    return k;
+}
+
+inline uint hashkey(unsigned long long k)
+{
+    k ^= k >> 33;
+    k *= 0xFF51AFD7ED558CCDULL;
+    k ^= k >> 33;
+    k *= 0xC4CEB9FE1A85EC53ULL;
+    k ^= k >> 33;
+    return uint(k);
+}
+
+inline uint hashkey(const std::string &k)
+{
+    uint h = 2166136261U; //FNV-1a
+    for(uint i = 0; i < k.size(); ++i)
+    {
+        h = (h ^ uchar(k[i])) * 16777619U;
+    }
+    return h;
+}
+
+// open addressing hash table with linear probing; removal shifts later entries of the probe run back
+template<class K, class T>
+struct hashindex
+{
+    struct slot
+    {
+        K key;
+        T value;
+        bool used;
+
+        slot() : used(false) {}
+    };
+    std::vector<slot> slots;
+    uint numused;
+
+    hashindex(uint size = 64) : slots(size), numused(0) {} //size must be a power of two
+
+    uint size() const
+    {
+        return numused;
+    }
+
+    uint mask() const
+    {
+        return slots.size() - 1;
+    }
+
+    T *find(const K &key)
+    {
+        for(uint i = hashkey(key) & mask();; i = (i + 1) & mask())
+        {
+            slot &s = slots[i];
+            if(!s.used)
+            {
+                return nullptr;
+            }
+            if(s.key == key)
+            {
+                return &s.value;
+            }
+        }
+    }
+
+    //returns the existing value for key, or inserts and returns init
+    T &access(const K &key, const T &init = T())
+    {
+        if(2*(numused + 1) > slots.size())
+        {
+            grow();
+        }
+        uint i = hashkey(key) & mask();
+        for(;; i = (i + 1) & mask())
+        {
+            slot &s = slots[i];
+            if(!s.used)
+            {
+                break;
+            }
+            if(s.key == key)
+            {
+                return s.value;
+            }
+        }
+        slot &s = slots[i];
+        s.key = key;
+        s.value = init;
+        s.used = true;
+        numused++;
+        return s.value;
+    }
+
+    bool remove(const K &key)
+    {
+        uint i = hashkey(key) & mask();
+        for(;; i = (i + 1) & mask())
+        {
+            if(!slots[i].used)
+            {
+                return false;
+            }
+            if(slots[i].key == key)
+            {
+                break;
+            }
+        }
+        for(uint j = i;;)
+        {
+            j = (j + 1) & mask();
+            if(!slots[j].used)
+            {
+                break;
+            }
+            uint home = hashkey(slots[j].key) & mask();
+            if(((j - home) & mask()) < ((j - i) & mask())) //entry at j cannot move before its home slot
+            {
+                continue;
+            }
+            slots[i] = slots[j];
+            i = j;
+        }
+        slots[i].used = false;
+        numused--;
+        return true;
+    }
+
+    void grow()
+    {
+        std::vector<slot> old(slots.size() * 2);
+        old.swap(slots);
+        numused = 0;
+        for(uint i = 0; i < old.size(); i++)
+        {
+            if(old[i].used)
+            {
+                access(old[i].key, old[i].value);
+            }
+        }
+    }
+
+    void clear()
+    {
+        for(uint i = 0; i < slots.size(); i++)
+        {
+            slots[i].used = false;
+        }
+        numused = 0;
+    }
+};
+
+struct slothandle
+{
+    uint index, generation;
+
+    unsigned long long id() const
+    {
+        return (static_cast<unsigned long long>(generation) << 32) | index;
+    }
+
+    static slothandle fromid(unsigned long long id)
+    {
+        slothandle h;
+        h.index = static_cast<uint>(id);
+        h.generation = static_cast<uint>(id >> 32);
+        return h;
+    }
+};
+
+// dense array of pointers addressed by generation tagged handles
+// removal swaps the last item into the hole, so handles stay valid but positions do not
+template<class T>
+struct slotmap
+{
+    struct slot
+    {
+        uint generation,
+             pos; //position in items while live, next free slot otherwise
+    };
+    std::vector<slot> slots;
+    std::vector<T *> items;
+    std::vector<uint> itemslots;
+    uint freeslot;
+
+    slotmap() : freeslot(~0U) {}
+
+    uint size() const
+    {
+        return items.size();
+    }
+
+    bool empty() const
+    {
+        return items.empty();
+    }
+
+    T *operator[](uint i) const
+    {
+        return items[i];
+    }
+
+    slothandle add(T *item)
+    {
+        uint index;
+        if(freeslot != ~0U)
+        {
+            index = freeslot;
+            freeslot = slots[index].pos;
+        }
+        else
+        {
+            index = slots.size();
+            slots.emplace_back();
+            slots.back().generation = 1;
+        }
+        slots[index].pos = items.size();
+        items.push_back(item);
+        itemslots.push_back(index);
+        slothandle h;
+        h.index = index;
+        h.generation = slots[index].generation;
+        return h;
+    }
+
+    T *get(const slothandle &h) const
+    {
+        if(h.index >= slots.size() || slots[h.index].generation != h.generation)
+        {
+            return nullptr;
+        }
+        return items[slots[h.index].pos];
+    }
+
+    bool remove(const slothandle &h)
+    {
+        if(!get(h))
+        {
+            return false;
+        }
+        slot &s = slots[h.index];
+        uint pos = s.pos;
+        items[pos] = items.back();
+        itemslots[pos] = itemslots.back();
+        slots[itemslots[pos]].pos = pos;
+        items.pop_back();
+        itemslots.pop_back();
+        if(!++s.generation) //generation 0 is never handed out
+        {
+            s.generation = 1;
+        }
+        s.pos = freeslot;
+        freeslot = h.index;
+        return true;
+    }
+};
+
+// fixed size objects carved from chunks of N, freed objects are reused before new chunks are allocated
+template<class T, int N = 64>
+struct slabpool
+{
+    union node
+    {
+        node *next;
+        alignas(T) char storage[sizeof(T)];
+    };
+    std::vector<node *> chunks;
+    node *freelist;
+    uint numused;
+
+    slabpool() : freelist(nullptr), numused(0) {}
+
+    ~slabpool()
+    {
+        for(uint i = 0; i < chunks.size(); i++)
+        {
+            delete[] chunks[i];
+        }
+    }
+
+    template<class... Args>
+    T *alloc(Args &&... args)
+    {
+        if(!freelist)
+        {
+            node *chunk = new node[N];
+            chunks.push_back(chunk);
+            for(int i = N; --i >= 0;) //note reverse iteration, so the chunk is handed out in order
+            {
+                chunk[i].next = freelist;
+                freelist = &chunk[i];
+            }
+        }
+        node *n = freelist;
+        freelist = n->next;
+        numused++;
+        return new (n->storage) T(std::forward<Args>(args)...);
+    }
+
+    void release(T *t)
+    {
+        t->~T();
+        node *n = reinterpret_cast<node *>(t);
+        n->next = freelist;
+        freelist = n;
+        numused--;
+    }
+};
+
+struct timer
+{
+    timer *prev, *next;
+    uint tick;
+    void (*expire)(timer &);
+    void *owner;
+
+    timer() : prev(nullptr), next(nullptr), tick(0), expire(nullptr), owner(nullptr) {}
+
+    bool scheduled() const
+    {
+        return next != nullptr;
+    }
+};
+
+// hierarchical timing wheel: each level has 64 slots, each slot spanning 64 slots of the level below
+// times are in milliseconds and may wrap, deadlines are rounded up to the tick resolution
+struct timerwheel
+{
+    static constexpr int LEVELS = 4,
+                         SLOTBITS = 6,
+                         SLOTS = 1<<SLOTBITS,
+                         TICKBITS = 4,
+                         TICK = 1<<TICKBITS;
+
+    timer slots[LEVELS][SLOTS]; //list heads
+    uint current, //next tick to expire
+         base, //time at which the current tick begins
+         count;
+
+    timerwheel();
+
+    void init(uint time);
+    void schedule(timer &t, uint deadline);
+    void cancel(timer &t);
+    void advance(uint time); //expires every timer due by time
+    int timeout(uint time) const; //milliseconds until advance() has work to do, or -1 if nothing is scheduled
+
+    private:
+        void place(timer &t);
+        void cascade(int level);
+};
+
+// bounded lock-free queue for any number of producers and consumers, after Dmitry Vyukov's design
+// each cell's sequence number says whether it is ready to be written or read at a given position
+template<class T, uint N> //N must be a power of two
+struct mpmcqueue
+{
+    mpmcqueue() : head(0), tail(0)
+    {
+        static_assert(N && !(N & (N-1)), "queue size must be a power of two");
+        for(uint i = 0; i < N; ++i)
+        {
+            cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    bool push(const T &item) //false if full
+    {
+        uint pos = tail.load(std::memory_order_relaxed);
+        for(;;)
+        {
+            cell &c = cells[pos & (N-1)];
+            int diff = static_cast<int>(c.seq.load(std::memory_order_acquire) - pos);
+            if(!diff)
+            {
+                if(tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    c.item = item;
+                    c.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if(diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool pop(T &item) //false if empty
+    {
+        uint pos = head.load(std::memory_order_relaxed);
+        for(;;)
+        {
+            cell &c = cells[pos & (N-1)];
+            int diff = static_cast<int>(c.seq.load(std::memory_order_acquire) - (pos + 1));
+            if(!diff)
+            {
+                if(head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    item = c.item;
+                    c.seq.store(pos + N, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if(diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    private:
+        struct cell
+        {
+            std::atomic<uint> seq;
+            T item;
+        };
+        cell cells[N];
+        alignas(64) std::atomic<uint> head; //own cache lines, so producers and consumers don't contend
+        alignas(64) std::atomic<uint> tail;
+};
+
+// log-linear histogram in the manner of HdrHistogram: each power of two is split into 8 buckets,
+// so values are reported to within 12.5%; any thread may add while another reads
+struct histogram
+{
+    histogram();
+
+    void add(unsigned long long v);
+    unsigned long long count() const;
+    unsigned long long sum() const;
+    unsigned long long percentile(double p) const; //upper bound of the bucket holding the p quantile
+
+    private:
+        static constexpr int SUBBITS = 3,
+                             SUBBUCKETS = 1<<SUBBITS,
+                             NUMBUCKETS = (64-SUBBITS+1)*SUBBUCKETS;
+        std::atomic<unsigned long long> buckets[NUMBUCKETS], total, valuesum;
+
+        static int bucket(unsigned long long v);
+        static unsigned long long bucketmax(int b);
+};
+
+// token buckets for many keys in a fixed-size, 4-way set associative table
+// a key missing from the table starts with a full bucket, so evicting the least recently
+// touched entry of a full set only forgets a key that has had time to refill
+struct ratelimiter
+{
+    ratelimiter(uint rate, uint burst, uint size = 4096); //rate in tokens per second, size a power of two
+
+    bool allow(uint key, uint time); //takes a token if one is left, time in milliseconds; safe from any thread
+    void clear(); //forgets every bucket, so each key starts again with a full burst
+
+    private:
+        static constexpr uint WAYS = 4;
+        static constexpr uint LOCKS = 64; //each set is guarded by one of these, so threads rarely wait on each other
+        struct entry
+        {
+            uint key, last, tokens; //tokens in thousandths
+            bool used;
+        };
+        std::vector<entry> entries;
+        std::mutex locks[LOCKS];
+        uint rate, burst;
+};
+
 struct ipmask
 {
     enet_uint32 ip, mask;
@@ -113,4 +595,36 @@ struct ipmask
     bool check(enet_uint32 host) const { return (host & mask) == ip; }
 };
 
+// set of ipmasks matched with the same result as checking each in turn
+// prefix masks are merged into sorted address ranges, others (such as 1.*.3.4) are checked linearly
+struct banlist
+{
+    std::vector<ipmask> masks; //as added, for printing
+
+    banlist() : dirty(false) {}
+
+    uint size() const
+    {
+        return masks.size();
+    }
+
+    void add(const ipmask &m);
+    void add(const char *name);
+    void clear();
+    void update(); //rebuilds the lookup tables if masks changed; must run before the list is published or checked
+    void diff(const banlist &old, banlist &added) const; //adds the masks missing from old to added
+    bool check(enet_uint32 host) const; //only reads, so any number of threads may check a published list
+
+    private:
+        struct range
+        {
+            enet_uint32 lo, hi; //host byte order, inclusive
+        };
+        std::vector<range> ranges;
+        std::vector<ipmask> irregular;
+        bool dirty;
+
+        void build();
+};
+
 #endif